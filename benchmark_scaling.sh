@@ -0,0 +1,35 @@
+#!/bin/sh
+# Runs the dispatcher on a long list of short jobs with 2 to 256 local ranks.
+# The dispatcher keeps up as long as its time per job stays flat and small
+# next to the time it spends waiting for free workers.
+#
+# usage: ./benchmark_scaling.sh [JOBS]
+
+JOBS=${1:-2000}
+SRC=$(cd "$(dirname "$0")" && pwd)/job_dispatcher_mpi.c
+DIR=$(mktemp -d)
+cd "$DIR" || exit 1
+
+mpicc -O2 -o dispatcher "$SRC" -lm -lpthread || exit 1
+
+i=0
+while [ $i -lt "$JOBS" ]; do
+    case $((i % 3)) in
+        0) echo "CLI$((i % 10)) PRIMEDIVISORS $((100000 + i * 7919))" ;;
+        1) echo "CLI$((i % 10)) PRIMES $((10000 + i * 13))" ;;
+        2) echo "CLI$((i % 10)) ANAGRAMS abc$((i % 7))" ;;
+    esac
+    i=$((i + 1))
+done > commands.txt
+
+# -c 0: the anagram words repeat, and cache hits would say nothing about workers
+printf "%6s %10s %14s %14s\n" ranks seconds "ms/job" "wait ms"
+for ranks in 2 4 8 16 32 64 128 256; do
+    mpirun --oversubscribe -np $ranks ./dispatcher -t 1 -c 0 > run.txt 2>&1 || { echo "run with $ranks ranks failed"; cat run.txt; break; }
+    seconds=$(sed -n 's/^Wall-clock time PARALLEL = \([0-9.]*\).*/\1/p' run.txt)
+    per_job=$(sed -n 's/.*dispatching (\([0-9.]*\) ms per job).*/\1/p' run.txt)
+    waited=$(sed -n 's/.*per job), \([0-9.]*\) ms waiting.*/\1/p' run.txt)
+    printf "%6d %10s %14s %14s\n" $ranks "$seconds" "$per_job" "$waited"
+done
+
+rm -rf "$DIR"
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Times a generated command list serially, on the local thread pool and on
+# the cluster for a range of worker counts, and prints the per-run reports as
+# one JSON array; comparing local_jobs_per_second with cluster_jobs_per_second
+# tells which suits the deployment.
+#
+# usage: ./benchmark_sweep.sh [JOBS] [MIX] [RANKS...]
+#   MIX is PRIMES:PRIMEDIVISORS:ANAGRAMS weights, default 4:4:2
+#   RANKS default to 2 3 5 9 17 (1 to 16 workers)
+
+JOBS=${1:-1000}
+MIX=${2:-4:4:2}
+[ $# -gt 2 ] && shift 2 || set -- 2 3 5 9 17
+SRC=$(cd "$(dirname "$0")" && pwd)/job_dispatcher_mpi.c
+DIR=$(mktemp -d)
+cd "$DIR" || exit 1
+
+mpicc -O2 -o dispatcher "$SRC" -lm -lpthread || exit 1
+
+echo "["
+separator=","
+if ! ./dispatcher -L -B "$JOBS" -m "$MIX" > run.txt 2>&1; then
+    echo "local run failed" >&2
+    cat run.txt >&2
+    separator=""
+else
+    cat benchmark.json
+fi
+for ranks in "$@"; do
+    rm -f CLI*.txt benchmark.json
+    if ! mpirun --oversubscribe -np "$ranks" ./dispatcher -B "$JOBS" -m "$MIX" -t 1 > run.txt 2>&1; then
+        echo "run with $ranks ranks failed" >&2
+        cat run.txt >&2
+        break
+    fi
+    printf "%s" "$separator"
+    cat benchmark.json
+    separator=","
+done
+echo "]"
+
+rm -rf "$DIR"
@@ -15,8 +15,13 @@ char *InputFileName;
 int debugMode = 0;
 int parallelType = 0;
 
+// both durations can be fixed per build, e.g. -DINFECTED_DURATION=3
+#ifndef INFECTED_DURATION
 #define INFECTED_DURATION 2
+#endif
+#ifndef IMMUNE_DURATION
 #define IMMUNE_DURATION 5
+#endif
 #define NORTH 0
 #define SOUTH 1
 #define EAST 2
@@ -44,8 +49,13 @@ typedef struct Person
 
 } Person;
 
+typedef int (*StepKernel)(int start, int end, int *leavingCells, int *leavingCount, int *enteringCells, int *enteringCount);
+
 Person *people;
 int **infectedGrid;
+int *gridCells;
+int gridStride;
+StepKernel stepKernel;
 
 int checkCoordinates(Person *a, Person *b)
 {
@@ -181,15 +191,15 @@ int compareFiles(char *file1, char *file2)
     return 0;
 }
 
-void move(Person *p)
+static inline void moveWithin(Person *p, int maxX, int maxY)
 {
     switch (p->movementPatternDirection)
     {
     case NORTH:
-        if (p->y + p->movementPatternAmplitude > MAX_Y_COORD)
+        if (p->y + p->movementPatternAmplitude > maxY)
         {
             p->movementPatternDirection = SOUTH;
-            p->y = MAX_Y_COORD - (p->y + p->movementPatternAmplitude - MAX_Y_COORD);
+            p->y = maxY - (p->y + p->movementPatternAmplitude - maxY);
         }
         else
         {
@@ -208,10 +218,10 @@ void move(Person *p)
         }
         break;
     case EAST:
-        if (p->x + p->movementPatternAmplitude > MAX_X_COORD)
+        if (p->x + p->movementPatternAmplitude > maxX)
         {
             p->movementPatternDirection = WEST;
-            p->x = MAX_X_COORD - (p->x + p->movementPatternAmplitude - MAX_X_COORD);
+            p->x = maxX - (p->x + p->movementPatternAmplitude - maxX);
         }
         else
         {
@@ -234,6 +244,75 @@ void move(Person *p)
     }
 }
 
+void move(Person *p)
+{
+    moveWithin(p, MAX_X_COORD, MAX_Y_COORD);
+}
+
+// position after `steps` moves along one axis, without replaying move():
+// bouncing between 0 and max is a triangle wave of period 2 * max over the
+// unfolded distance amplitude * steps
+int reflectCoordinate(int position, int *increasing, int amplitude, int max, long steps)
+{
+    if (steps <= 0 || amplitude == 0 || max == 0)
+    {
+        return position;
+    }
+
+    long period = 2L * max;
+    long unfolded = *increasing ? position : period - position;
+    long phase = (unfolded + (long)amplitude * steps) % period;
+
+    // landing exactly on a border keeps the direction of arrival, like move()
+    *increasing = (phase > 0 && phase <= max);
+
+    return (phase <= max) ? phase : period - phase;
+}
+
+void moveSteps(Person *p, long steps)
+{
+    int increasing;
+
+    switch (p->movementPatternDirection)
+    {
+    case NORTH:
+    case SOUTH:
+        increasing = (p->movementPatternDirection == NORTH);
+        p->y = reflectCoordinate(p->y, &increasing, p->movementPatternAmplitude, MAX_Y_COORD, steps);
+        p->movementPatternDirection = increasing ? NORTH : SOUTH;
+        break;
+    case EAST:
+    case WEST:
+        increasing = (p->movementPatternDirection == EAST);
+        p->x = reflectCoordinate(p->x, &increasing, p->movementPatternAmplitude, MAX_X_COORD, steps);
+        p->movementPatternDirection = increasing ? EAST : WEST;
+        break;
+    default:
+        break;
+    }
+}
+
+// once nobody is infected, the remaining steps only move people and count
+// down immunity, so they can be applied in one go
+void fastForward(Person *p, long steps)
+{
+    moveSteps(p, steps);
+
+    if (p->currentStatus == IMMUNE)
+    {
+        if (p->immunityDuration <= steps)
+        {
+            p->immunityDuration = 0;
+            p->currentStatus = SUSCEPTIBLE;
+        }
+        else
+        {
+            p->immunityDuration -= steps;
+        }
+    }
+    p->futureStatus = p->currentStatus;
+}
+
 void updateStatusOnePerson(Person *p)
 {
     if (p->currentStatus == INFECTED)
@@ -283,7 +362,7 @@ void updateGrid()
     {
         if (people[i].currentStatus == INFECTED)
         {
-            infectedGrid[people[i].x][people[i].y] = 1;
+            infectedGrid[people[i].x][people[i].y]++;
         }
     }
 }
@@ -299,6 +378,89 @@ void setFutureStatus(int start, int end)
     }
 }
 
+// one movement pass of the active-set variant over people[start, end): checks
+// contacts against the grid of the previous step, moves, updates the status and
+// records the grid cells infected people leave and enter. The bounds and the
+// grid stride are parameters so that the specialized kernels below get them as
+// compile-time constants.
+static inline __attribute__((always_inline)) int stepRange(int start, int end, int maxX, int maxY, int stride,
+                                                           int *leavingCells, int *leavingCount,
+                                                           int *enteringCells, int *enteringCount)
+{
+    int leaving = 0;
+    int entering = 0;
+    int infectedCount = 0;
+
+    for (int i = start; i < end; i++)
+    {
+        Person *p = &people[i];
+        int wasInfected = (p->currentStatus == INFECTED);
+        int oldCell = p->x * stride + p->y;
+
+        if (p->currentStatus == SUSCEPTIBLE && gridCells[oldCell])
+        {
+            p->futureStatus = INFECTED;
+        }
+        moveWithin(p, maxX, maxY);
+        updateStatusOnePerson(p);
+        p->currentStatus = p->futureStatus;
+
+        int isInfected = (p->currentStatus == INFECTED);
+        int newCell = p->x * stride + p->y;
+        if (wasInfected && !(isInfected && newCell == oldCell))
+        {
+            leavingCells[leaving++] = oldCell;
+        }
+        if (isInfected && !(wasInfected && newCell == oldCell))
+        {
+            enteringCells[entering++] = newCell;
+        }
+        infectedCount += isInfected;
+    }
+
+    *leavingCount = leaving;
+    *enteringCount = entering;
+    return infectedCount;
+}
+
+int stepRangeGeneric(int start, int end, int *leavingCells, int *leavingCount, int *enteringCells, int *enteringCount)
+{
+    return stepRange(start, end, MAX_X_COORD, MAX_Y_COORD, gridStride, leavingCells, leavingCount, enteringCells, enteringCount);
+}
+
+#ifdef SPECIALIZED_KERNELS
+// map sizes of the production scenarios: MAX_X_COORD, MAX_Y_COORD and the
+// power-of-two row stride the grid gets in this build
+#define SPECIALIZED_GRIDS(KERNEL) \
+    KERNEL(4, 4, 8)               \
+    KERNEL(400, 300, 512)         \
+    KERNEL(400, 400, 512)
+
+#define DEFINE_STEP_KERNEL(maxX, maxY, stride)                                                                    \
+    int stepRange_##maxX##x##maxY(int start, int end, int *leavingCells, int *leavingCount,                      \
+                                  int *enteringCells, int *enteringCount)                                          \
+    {                                                                                                              \
+        return stepRange(start, end, maxX, maxY, stride, leavingCells, leavingCount, enteringCells, enteringCount); \
+    }
+
+SPECIALIZED_GRIDS(DEFINE_STEP_KERNEL)
+#endif
+
+StepKernel selectStepKernel()
+{
+#ifdef SPECIALIZED_KERNELS
+#define SELECT_STEP_KERNEL(maxX, maxY, stride)                                  \
+    if (MAX_X_COORD == maxX && MAX_Y_COORD == maxY && gridStride == stride)     \
+    {                                                                           \
+        printf("using step kernel specialized for %dx%d\n", maxX, maxY);        \
+        return stepRange_##maxX##x##maxY;                                       \
+    }
+
+    SPECIALIZED_GRIDS(SELECT_STEP_KERNEL)
+#endif
+    return stepRangeGeneric;
+}
+
 void computeSerial()
 {
     for (int time = 1; time <= TOTAL_SIMULATION_TIME; time++)
@@ -314,14 +476,25 @@ void computeSerial()
             people[i].currentStatus = people[i].futureStatus;
         }
 
+        int infectedCount = 0;
         for (int i = 0; i < N; i++)
         {
             if (people[i].currentStatus == INFECTED)
             {
                 infectedGrid[people[i].x][people[i].y] = 1;
+                infectedCount++;
             }
         }
 
+        if (!debugMode && infectedCount == 0)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                fastForward(&people[i], TOTAL_SIMULATION_TIME - time);
+            }
+            break;
+        }
+
         setFutureStatus(0, N);
 
         if (debugMode)
@@ -334,10 +507,16 @@ void computeSerial()
 
 void outer_parallel_for()
 {
+    int infectedCount = 0;
+
     #pragma omp parallel num_threads(ThreadNumber)
         for (int t = 1; t <= TOTAL_SIMULATION_TIME; t++)
         {
             //printf("%d\n", omp_get_thread_num());
+            // every thread read the previous count before the last barrier
+            #pragma omp single nowait
+                infectedCount = 0;
+
             #pragma omp for schedule(static)
                 for (int i = 0; i < N; i++)
                 {
@@ -355,15 +534,26 @@ void outer_parallel_for()
                     people[i].currentStatus = people[i].futureStatus;
                 }
 
-            #pragma omp for schedule(static)
+            #pragma omp for schedule(static) reduction(+:infectedCount)
                 for (int i = 0; i < N; i++)
                 {
                     if (people[i].currentStatus == INFECTED)
                     {
                         infectedGrid[people[i].x][people[i].y] = 1;
+                        infectedCount++;
                     }
                 }
 
+            if (!debugMode && infectedCount == 0)
+            {
+                #pragma omp for schedule(static)
+                    for (int i = 0; i < N; i++)
+                    {
+                        fastForward(&people[i], TOTAL_SIMULATION_TIME - t);
+                    }
+                break;
+            }
+
             #pragma omp for schedule(static)
                 for (int i = 0; i < N; i++)
                 {
@@ -400,15 +590,27 @@ void inner_parallel_for()
                 people[i].currentStatus = people[i].futureStatus;
             }
 
-        #pragma omp parallel for num_threads(ThreadNumber) schedule(static)
+        int infectedCount = 0;
+        #pragma omp parallel for num_threads(ThreadNumber) schedule(static) reduction(+:infectedCount)
             for (int i = 0; i < N; i++)
             {
                 if (people[i].currentStatus == INFECTED)
                 {
                     infectedGrid[people[i].x][people[i].y] = 1;
+                    infectedCount++;
                 }
             }
 
+        if (!debugMode && infectedCount == 0)
+        {
+            #pragma omp parallel for num_threads(ThreadNumber) schedule(static)
+                for (int i = 0; i < N; i++)
+                {
+                    fastForward(&people[i], TOTAL_SIMULATION_TIME - t);
+                }
+            break;
+        }
+
         #pragma omp parallel for num_threads(ThreadNumber) schedule(static)
             for (int i = 0; i < N; i++)
             {
@@ -432,6 +634,8 @@ void inner_parallel_for()
 
 void omp_data_partitioning()
 {
+    int infectedCounts[ThreadNumber];
+
     #pragma omp parallel num_threads(ThreadNumber)
     {
         int thread_rank = omp_get_thread_num();
@@ -454,15 +658,33 @@ void omp_data_partitioning()
             }
             #pragma omp barrier
 
+            int infectedCount = 0;
             for (int i = start; i < end; i++)
             {
                 if (people[i].currentStatus == INFECTED)
                 {
                     infectedGrid[people[i].x][people[i].y] = 1;
+                    infectedCount++;
                 }
             }
+            infectedCounts[thread_rank] = infectedCount;
             #pragma omp barrier
 
+            // every thread sums the same counts, so all of them leave together
+            infectedCount = 0;
+            for (int i = 0; i < ThreadNumber; i++)
+            {
+                infectedCount += infectedCounts[i];
+            }
+            if (!debugMode && infectedCount == 0)
+            {
+                for (int i = start; i < end; i++)
+                {
+                    fastForward(&people[i], TOTAL_SIMULATION_TIME - t);
+                }
+                break;
+            }
+
             setFutureStatus(start, end);
             #pragma omp barrier
 
@@ -479,11 +701,85 @@ void omp_data_partitioning()
     }
 }
 
+// active-set variant: every thread records the cells its infected people leave
+// and enter, and the grid counts the infected people in each cell, so it is
+// only touched by infections, recoveries and moves of infected people and never
+// needs to be cleared. The contact check of a step is folded into the movement
+// pass of the next one, which visits everyone anyway.
+void omp_active_set()
+{
+    int infectedCounts[ThreadNumber];
+
+    #pragma omp parallel num_threads(ThreadNumber)
+    {
+        int thread_rank = omp_get_thread_num();
+        int start = (thread_rank * N) / ThreadNumber;
+        int end = (thread_rank == ThreadNumber - 1) ? N : ((thread_rank + 1) * N) / ThreadNumber;
+
+        int *leavingCells = malloc((end - start + 1) * sizeof(int));
+        int *enteringCells = malloc((end - start + 1) * sizeof(int));
+        if (leavingCells == NULL || enteringCells == NULL)
+        {
+            perror("error allocating memory for active cells\n");
+            exit(-1);
+        }
+
+        for (int t = 1; t <= TOTAL_SIMULATION_TIME; t++)
+        {
+            int leavingCount;
+            int enteringCount;
+            int infectedCount = stepKernel(start, end, leavingCells, &leavingCount, enteringCells, &enteringCount);
+            infectedCounts[thread_rank] = infectedCount;
+            #pragma omp barrier
+
+            for (int i = 0; i < leavingCount; i++)
+            {
+                #pragma omp atomic
+                gridCells[leavingCells[i]]--;
+            }
+            for (int i = 0; i < enteringCount; i++)
+            {
+                #pragma omp atomic
+                gridCells[enteringCells[i]]++;
+            }
+
+            // every thread sums the same counts, so all of them leave together
+            infectedCount = 0;
+            for (int i = 0; i < ThreadNumber; i++)
+            {
+                infectedCount += infectedCounts[i];
+            }
+            if (!debugMode && infectedCount == 0)
+            {
+                for (int i = start; i < end; i++)
+                {
+                    fastForward(&people[i], TOTAL_SIMULATION_TIME - t);
+                }
+                break;
+            }
+            #pragma omp barrier
+
+            if (debugMode)
+            {
+                if (thread_rank == 0)
+                {
+                    printf("Parallel Iteration: %d\n", t);
+                    displayPeople();
+                }
+                #pragma omp barrier
+            }
+        }
+
+        free(leavingCells);
+        free(enteringCells);
+    }
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 6)
     {
-        printf("Usage: %s TOTAL_SIMULATION_TIME InputFileName ThreadNumber MODE(debug-1 / normal-0) FUNCTION(inner parallel for-0 / outer parallel for-1 / omp data partitioning-2\n", argv[0]);
+        printf("Usage: %s TOTAL_SIMULATION_TIME InputFileName ThreadNumber MODE(debug-1 / normal-0) FUNCTION(inner parallel for-0 / outer parallel for-1 / omp data partitioning-2 / omp active set-3)\n", argv[0]);
         exit(-1);
     }
 
@@ -523,21 +819,27 @@ int main(int argc, char *argv[])
         displayPeople();
     }
 
+    // the rows share one block so the active-set kernels can index it flat
+    gridStride = MAX_Y_COORD + 1;
+#ifdef SPECIALIZED_KERNELS
+    // power-of-two rows turn the specialized kernels' grid indexing into shifts
+    while (gridStride & (gridStride - 1))
+    {
+        gridStride++;
+    }
+#endif
+    gridCells = calloc((MAX_X_COORD + 1) * gridStride, sizeof(int));
     infectedGrid = malloc((MAX_X_COORD + 1) * sizeof(int *));
-    if (infectedGrid == NULL)
+    if (gridCells == NULL || infectedGrid == NULL)
     {
         perror("error allocating memory for grid\n");
         exit(-1);
     }
     for (int i = 0; i <= MAX_X_COORD; i++)
     {
-        infectedGrid[i] = calloc(MAX_Y_COORD + 1, sizeof(int));
-        if (infectedGrid[i] == NULL)
-        {
-            perror("error allocating memory for grid row\n");
-            exit(-1);
-        }
+        infectedGrid[i] = gridCells + i * gridStride;
     }
+    stepKernel = selectStepKernel();
 
     clock_gettime(CLOCK_MONOTONIC, &start);
     updateGrid();
@@ -576,6 +878,10 @@ int main(int argc, char *argv[])
     {
         omp_data_partitioning();
     }
+    else if(parallelType == 3)
+    {
+        omp_active_set();
+    }
     else
     {
         perror("invalid parallel call type\n");
@@ -604,11 +910,8 @@ int main(int argc, char *argv[])
         printf("\nserial output DIFFERENT from parallel output\n\n");
     }
 
-    for (int i = 0; i <= MAX_X_COORD; i++)
-    {
-        free(infectedGrid[i]);
-    }
     free(infectedGrid);
+    free(gridCells);
 
     free(people);
     free(serialOut);
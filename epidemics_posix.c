@@ -12,9 +12,15 @@ int TOTAL_SIMULATION_TIME = 0;
 int ThreadNumber = 0;
 char *InputFileName;
 int debugMode = 0;
+int parallelType = 0;
 
+// both durations can be fixed per build, e.g. -DINFECTED_DURATION=3
+#ifndef INFECTED_DURATION
 #define INFECTED_DURATION 5
+#endif
+#ifndef IMMUNE_DURATION
 #define IMMUNE_DURATION 3
+#endif
 #define NORTH 0
 #define SOUTH 1
 #define EAST 2
@@ -38,9 +44,15 @@ typedef struct Person
 
 } Person;
 
+typedef int (*StepKernel)(int start, int end, int *leavingCells, int *leavingCount, int *enteringCells, int *enteringCount);
+
 Person *people;
 int **infectedGrid;
+int *gridCells;
+int gridStride;
+StepKernel stepKernel;
 pthread_barrier_t barrier;
+int *infectedCounts;
 
 int checkCoordinates(Person *a, Person *b)
 {
@@ -134,15 +146,15 @@ void saveResultsToFile(char *filename)
     fclose(file);
 }
 
-void move(Person *p)
+static inline void moveWithin(Person *p, int maxX, int maxY)
 {
     switch (p->movementPatternDirection)
     {
     case NORTH:
-        if (p->y + p->movementPatternAmplitude > MAX_Y_COORD)
+        if (p->y + p->movementPatternAmplitude > maxY)
         {
             p->movementPatternDirection = SOUTH;
-            p->y = MAX_Y_COORD - (p->y + p->movementPatternAmplitude - MAX_Y_COORD);
+            p->y = maxY - (p->y + p->movementPatternAmplitude - maxY);
         }
         else
         {
@@ -161,10 +173,10 @@ void move(Person *p)
         }
         break;
     case EAST:
-        if (p->x + p->movementPatternAmplitude > MAX_X_COORD)
+        if (p->x + p->movementPatternAmplitude > maxX)
         {
             p->movementPatternDirection = WEST;
-            p->x = MAX_X_COORD - (p->x + p->movementPatternAmplitude - MAX_X_COORD);
+            p->x = maxX - (p->x + p->movementPatternAmplitude - maxX);
         }
         else
         {
@@ -187,6 +199,75 @@ void move(Person *p)
     }
 }
 
+void move(Person *p)
+{
+    moveWithin(p, MAX_X_COORD, MAX_Y_COORD);
+}
+
+// position after `steps` moves along one axis, without replaying move():
+// bouncing between 0 and max is a triangle wave of period 2 * max over the
+// unfolded distance amplitude * steps
+int reflectCoordinate(int position, int *increasing, int amplitude, int max, long steps)
+{
+    if (steps <= 0 || amplitude == 0 || max == 0)
+    {
+        return position;
+    }
+
+    long period = 2L * max;
+    long unfolded = *increasing ? position : period - position;
+    long phase = (unfolded + (long)amplitude * steps) % period;
+
+    // landing exactly on a border keeps the direction of arrival, like move()
+    *increasing = (phase > 0 && phase <= max);
+
+    return (phase <= max) ? phase : period - phase;
+}
+
+void moveSteps(Person *p, long steps)
+{
+    int increasing;
+
+    switch (p->movementPatternDirection)
+    {
+    case NORTH:
+    case SOUTH:
+        increasing = (p->movementPatternDirection == NORTH);
+        p->y = reflectCoordinate(p->y, &increasing, p->movementPatternAmplitude, MAX_Y_COORD, steps);
+        p->movementPatternDirection = increasing ? NORTH : SOUTH;
+        break;
+    case EAST:
+    case WEST:
+        increasing = (p->movementPatternDirection == EAST);
+        p->x = reflectCoordinate(p->x, &increasing, p->movementPatternAmplitude, MAX_X_COORD, steps);
+        p->movementPatternDirection = increasing ? EAST : WEST;
+        break;
+    default:
+        break;
+    }
+}
+
+// once nobody is infected, the remaining steps only move people and count
+// down immunity, so they can be applied in one go
+void fastForward(Person *p, long steps)
+{
+    moveSteps(p, steps);
+
+    if (p->currentStatus == IMMUNE)
+    {
+        if (p->immunityDuration <= steps)
+        {
+            p->immunityDuration = 0;
+            p->currentStatus = SUSCEPTIBLE;
+        }
+        else
+        {
+            p->immunityDuration -= steps;
+        }
+    }
+    p->futureStatus = p->currentStatus;
+}
+
 void updateStatusOnePerson(Person *p)
 {
     if (p->currentStatus == INFECTED)
@@ -236,7 +317,7 @@ void updateGrid()
     {
         if (people[i].currentStatus == INFECTED)
         {
-            infectedGrid[people[i].x][people[i].y] = 1;
+            infectedGrid[people[i].x][people[i].y]++;
         }
     }
 }
@@ -252,6 +333,89 @@ void setFutureStatus(int start, int end)
     }
 }
 
+// one movement pass of the active-set variant over people[start, end): checks
+// contacts against the grid of the previous step, moves, updates the status and
+// records the grid cells infected people leave and enter. The bounds and the
+// grid stride are parameters so that the specialized kernels below get them as
+// compile-time constants.
+static inline __attribute__((always_inline)) int stepRange(int start, int end, int maxX, int maxY, int stride,
+                                                           int *leavingCells, int *leavingCount,
+                                                           int *enteringCells, int *enteringCount)
+{
+    int leaving = 0;
+    int entering = 0;
+    int infectedCount = 0;
+
+    for (int i = start; i < end; i++)
+    {
+        Person *p = &people[i];
+        int wasInfected = (p->currentStatus == INFECTED);
+        int oldCell = p->x * stride + p->y;
+
+        if (p->currentStatus == SUSCEPTIBLE && gridCells[oldCell])
+        {
+            p->futureStatus = INFECTED;
+        }
+        moveWithin(p, maxX, maxY);
+        updateStatusOnePerson(p);
+        p->currentStatus = p->futureStatus;
+
+        int isInfected = (p->currentStatus == INFECTED);
+        int newCell = p->x * stride + p->y;
+        if (wasInfected && !(isInfected && newCell == oldCell))
+        {
+            leavingCells[leaving++] = oldCell;
+        }
+        if (isInfected && !(wasInfected && newCell == oldCell))
+        {
+            enteringCells[entering++] = newCell;
+        }
+        infectedCount += isInfected;
+    }
+
+    *leavingCount = leaving;
+    *enteringCount = entering;
+    return infectedCount;
+}
+
+int stepRangeGeneric(int start, int end, int *leavingCells, int *leavingCount, int *enteringCells, int *enteringCount)
+{
+    return stepRange(start, end, MAX_X_COORD, MAX_Y_COORD, gridStride, leavingCells, leavingCount, enteringCells, enteringCount);
+}
+
+#ifdef SPECIALIZED_KERNELS
+// map sizes of the production scenarios: MAX_X_COORD, MAX_Y_COORD and the
+// power-of-two row stride the grid gets in this build
+#define SPECIALIZED_GRIDS(KERNEL) \
+    KERNEL(4, 4, 8)               \
+    KERNEL(400, 300, 512)         \
+    KERNEL(400, 400, 512)
+
+#define DEFINE_STEP_KERNEL(maxX, maxY, stride)                                                                    \
+    int stepRange_##maxX##x##maxY(int start, int end, int *leavingCells, int *leavingCount,                      \
+                                  int *enteringCells, int *enteringCount)                                          \
+    {                                                                                                              \
+        return stepRange(start, end, maxX, maxY, stride, leavingCells, leavingCount, enteringCells, enteringCount); \
+    }
+
+SPECIALIZED_GRIDS(DEFINE_STEP_KERNEL)
+#endif
+
+StepKernel selectStepKernel()
+{
+#ifdef SPECIALIZED_KERNELS
+#define SELECT_STEP_KERNEL(maxX, maxY, stride)                                  \
+    if (MAX_X_COORD == maxX && MAX_Y_COORD == maxY && gridStride == stride)     \
+    {                                                                           \
+        printf("using step kernel specialized for %dx%d\n", maxX, maxY);        \
+        return stepRange_##maxX##x##maxY;                                       \
+    }
+
+    SPECIALIZED_GRIDS(SELECT_STEP_KERNEL)
+#endif
+    return stepRangeGeneric;
+}
+
 void computeSerial()
 {
     for (int time = 1; time <= TOTAL_SIMULATION_TIME; time++)
@@ -267,12 +431,23 @@ void computeSerial()
             people[i].currentStatus = people[i].futureStatus;
         }
 
+        int infectedCount = 0;
         for(int i = 0; i < N; i++)
         {
             if(people[i].currentStatus == INFECTED)
             {
                 infectedGrid[people[i].x][people[i].y] = 1;
+                infectedCount++;
+            }
+        }
+
+        if (!debugMode && infectedCount == 0)
+        {
+            for (int i = 0; i < N; i++)
+            {
+                fastForward(&people[i], TOTAL_SIMULATION_TIME - time);
             }
+            break;
         }
 
         setFutureStatus(0, N);
@@ -307,15 +482,33 @@ void *compute_parallel(void *arg)
         }
         pthread_barrier_wait(&barrier);
 
+        int infectedCount = 0;
         for(int i = start; i < end; i++)
         {
             if(people[i].currentStatus == INFECTED)
             {
                 infectedGrid[people[i].x][people[i].y] = 1;
+                infectedCount++;
             }
         }
+        infectedCounts[thread_id] = infectedCount;
         pthread_barrier_wait(&barrier);
 
+        // every thread sums the same counts, so all of them leave together
+        infectedCount = 0;
+        for (int i = 0; i < ThreadNumber; i++)
+        {
+            infectedCount += infectedCounts[i];
+        }
+        if (!debugMode && infectedCount == 0)
+        {
+            for (int i = start; i < end; i++)
+            {
+                fastForward(&people[i], TOTAL_SIMULATION_TIME - t);
+            }
+            break;
+        }
+
         setFutureStatus(start, end);
         pthread_barrier_wait(&barrier);
 
@@ -332,6 +525,76 @@ void *compute_parallel(void *arg)
     pthread_exit(NULL);
 }
 
+// active-set variant: every thread records the cells its infected people leave
+// and enter, and the grid counts the infected people in each cell, so it is
+// only touched by infections, recoveries and moves of infected people and never
+// needs to be cleared. The contact check of a step is folded into the movement
+// pass of the next one, which visits everyone anyway.
+void *compute_parallel_active(void *arg)
+{
+    int thread_id = *(int *)arg;
+    int start = (thread_id * N) / ThreadNumber;
+    int end = (thread_id == ThreadNumber - 1) ? N : ((thread_id + 1) * N) / ThreadNumber;
+
+    printf("thread id: %d; start: %d, end: %d\n", thread_id, start, end);
+
+    int *leavingCells = malloc((end - start + 1) * sizeof(int));
+    int *enteringCells = malloc((end - start + 1) * sizeof(int));
+    if (leavingCells == NULL || enteringCells == NULL)
+    {
+        perror("error allocating memory for active cells\n");
+        exit(-1);
+    }
+
+    for (int t = 1; t <= TOTAL_SIMULATION_TIME; t++)
+    {
+        int leavingCount;
+        int enteringCount;
+        int infectedCount = stepKernel(start, end, leavingCells, &leavingCount, enteringCells, &enteringCount);
+        infectedCounts[thread_id] = infectedCount;
+        pthread_barrier_wait(&barrier);
+
+        for (int i = 0; i < leavingCount; i++)
+        {
+            __atomic_fetch_sub(&gridCells[leavingCells[i]], 1, __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < enteringCount; i++)
+        {
+            __atomic_fetch_add(&gridCells[enteringCells[i]], 1, __ATOMIC_RELAXED);
+        }
+
+        // every thread sums the same counts, so all of them leave together
+        infectedCount = 0;
+        for (int i = 0; i < ThreadNumber; i++)
+        {
+            infectedCount += infectedCounts[i];
+        }
+        if (!debugMode && infectedCount == 0)
+        {
+            for (int i = start; i < end; i++)
+            {
+                fastForward(&people[i], TOTAL_SIMULATION_TIME - t);
+            }
+            break;
+        }
+        pthread_barrier_wait(&barrier);
+
+        if (debugMode)
+        {
+            if (thread_id == 0)
+            {
+                printf("Parallel Iteration: %d\n", t);
+                displayPeople();
+            }
+            pthread_barrier_wait(&barrier);
+        }
+    }
+
+    free(leavingCells);
+    free(enteringCells);
+    pthread_exit(NULL);
+}
+
 int compareFiles(char *file1, char *file2)
 {
     FILE *f1 = fopen(file1, "r");
@@ -377,9 +640,9 @@ int compareFiles(char *file1, char *file2)
 
 int main(int argc, char *argv[])
 {
-    if (argc != 5)
+    if (argc != 5 && argc != 6)
     {
-        printf("Usage: %s TOTAL_SIMULATION_TIME InputFileName ThreadNumber MODE(debug-1 / normal-0)\n", argv[0]);
+        printf("Usage: %s TOTAL_SIMULATION_TIME InputFileName ThreadNumber MODE(debug-1 / normal-0) [FUNCTION(data partitioning-0 / active set-1)]\n", argv[0]);
         exit(-1);
     }
 
@@ -387,6 +650,15 @@ int main(int argc, char *argv[])
     InputFileName = argv[2];
     ThreadNumber = atoi(argv[3]);
     debugMode = atoi(argv[4]);
+    if (argc == 6)
+    {
+        parallelType = atoi(argv[5]);
+    }
+    if (parallelType != 0 && parallelType != 1)
+    {
+        perror("invalid parallel call type\n");
+        exit(-1);
+    }
 
     struct timespec start, finish;
 
@@ -413,21 +685,27 @@ int main(int argc, char *argv[])
         displayPeople();
     }
 
+    // the rows share one block so the active-set kernels can index it flat
+    gridStride = MAX_Y_COORD + 1;
+#ifdef SPECIALIZED_KERNELS
+    // power-of-two rows turn the specialized kernels' grid indexing into shifts
+    while (gridStride & (gridStride - 1))
+    {
+        gridStride++;
+    }
+#endif
+    gridCells = calloc((MAX_X_COORD + 1) * gridStride, sizeof(int));
     infectedGrid = malloc((MAX_X_COORD + 1) * sizeof(int *));
-    if (infectedGrid == NULL)
+    if (gridCells == NULL || infectedGrid == NULL)
     {
         perror("error allocating memory for grid\n");
         exit(-1);
     }
     for (int i = 0; i <= MAX_X_COORD; i++)
     {
-        infectedGrid[i] = calloc(MAX_Y_COORD + 1, sizeof(int));
-        if (infectedGrid[i] == NULL)
-        {
-            perror("error allocating memory for grid row\n");
-            exit(-1);
-        }
+        infectedGrid[i] = gridCells + i * gridStride;
     }
+    stepKernel = selectStepKernel();
 
     clock_gettime(CLOCK_MONOTONIC, &start);
     updateGrid();
@@ -451,6 +729,12 @@ int main(int argc, char *argv[])
     }
 
     pthread_barrier_init(&barrier, NULL, ThreadNumber);
+    infectedCounts = calloc(ThreadNumber, sizeof(int));
+    if (infectedCounts == NULL)
+    {
+        perror("error allocating memory for infected counts\n");
+        exit(-1);
+    }
     pthread_t threads[ThreadNumber];
     int thread_ids[ThreadNumber];
 
@@ -460,7 +744,7 @@ int main(int argc, char *argv[])
     for (int i = 0; i < ThreadNumber; i++)
     {
         thread_ids[i] = i;
-        if(pthread_create(&threads[i], NULL, compute_parallel, (void *)&thread_ids[i]) != 0)
+        if(pthread_create(&threads[i], NULL, parallelType == 1 ? compute_parallel_active : compute_parallel, (void *)&thread_ids[i]) != 0)
         {
             perror("error creating thread\n");
             exit(-1);
@@ -474,6 +758,7 @@ int main(int argc, char *argv[])
     double time_taken_parallel = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
 
     pthread_barrier_destroy(&barrier);
+    free(infectedCounts);
 
     saveResultsToFile(parallelOut);
     
@@ -493,11 +778,8 @@ int main(int argc, char *argv[])
         printf("\nserial output DIFFERENT from parallel output\n\n");
     }
 
-    for (int i = 0; i <= MAX_X_COORD; i++)
-    {
-        free(infectedGrid[i]);
-    }
     free(infectedGrid);
+    free(gridCells);
 
     free(people);
     free(serialOut);
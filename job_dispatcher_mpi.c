@@ -2,17 +2,106 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <math.h>
 #include <time.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #define INPUT_FILE "commands.txt"
 #define LOG_FILE_S "log_s.txt"
 #define LOG_FILE_P "log_p.txt"
-#define MAX_WORKERS 11
+#define LOG_FILE_BINARY "log_p.bin"
+#define BENCHMARK_COMMANDS "bench_commands.txt"
+#define BENCHMARK_REPORT "benchmark.json"
 #define BUFFER_SIZE 1024
-#define ANAGRAM_BUFFER_SIZE (40320 * 9 + 100)
+#define PREFETCH_DEPTH 2                                    // default number of jobs queued on each worker
+#define ANAGRAM_CHUNK_SIZE (64 * 1024)                      // anagram results are streamed in chunks of this size
+#define SIEVE_SEGMENT_WORDS 4096                            // 32 KB of bits per segment, sized for L1
+#define SIEVE_SEGMENT_SPAN (SIEVE_SEGMENT_WORDS * 64LL * 2) // one bit per odd number
+#define PRESIEVE_WORDS 105                                  // multiples of 3, 5 and 7 repeat every 105 words
+#define PRIMES_SPLIT_MIN (4 * SIEVE_SEGMENT_SPAN)           // smaller PRIMES jobs go to a single worker
+#define TRIAL_DIVISION_LIMIT 65536                          // trial division alone factors anything below 2^32
+#define MAX_WORD_LENGTH 32
+#define ANAGRAM_OUTPUT_LIMIT (128LL << 20)                  // ANAGRAMS that would write more are refused
+#define RESULT_CACHE_MB 64                                  // default memory budget of the result cache
+#define RESULT_CACHE_BUCKETS 4096
+#define CLIENT_FD_LIMIT 64                                  // client files kept open by the writer
+#define WRITE_BATCH_BYTES (256 * 1024)                      // the writer wakes early once this much is queued
+#define WRITE_FLUSH_MS 50                                   // and otherwise this long after the first queued write
+#define WRITE_QUEUE_LIMIT (64 * 1024 * 1024)                // the receiver waits beyond this, disk being far behind
+#define WRITE_IOV_MAX 64
+#define EVENT_RING_SIZE 65536                               // events buffered per logging thread, a power of two
+#define LOG_DRAIN_MS 10
+#define LOAD_SEED 12345                                     // the generated load is the same on every run
+#define MAX_PENDING_JOBS 4096                               // input stops reading beyond this, pushing back on its writers
+#define MAX_STREAM_CLIENTS 64                               // connections served at once on a command socket
+#define BENCHMARK_PRIMES_MAX 20000000                       // largest N of generated PRIMES commands
+#define BENCHMARK_WORD_MIN 3                                // generated anagram words have 3 to 8 letters
+#define BENCHMARK_WORD_MAX 8
+#define DEADLINE_MIN_MS 10000                               // default floor of a job's deadline
+#define DEADLINE_FACTOR 8                                   // a job may overrun its estimate this many times
+#define WATCHDOG_MS 100                                     // how often the deadlines are checked
+#define MAX_JOB_TIMEOUTS 3                                  // a command that times out this often is given up
+#define WORKER_STRIKES 2                                    // jobs timed out on in a row that exclude a worker
+#define CANCELLED_TICKETS 64                                // cancelled dispatches a worker remembers
+#define PRIORITY_CLASSES 3                                  // class 0 is served first
+#define DRR_QUANTUM_MS 10.0                                 // estimated work a client gets per round
+#define SHARED_RING_SLOTS 8                                 // anagram chunks a worker can have in shared memory
+
+#define TAG_COMMAND 0   // main server -> worker
+#define TAG_RESULT 0    // a whole result
+#define TAG_CHUNK 1     // part of a streamed result; an empty chunk ends the stream
+#define TAG_PART 3      // prime count of one PRIMESRANGE part, no text
+#define TAG_STOP 4      // the worker acknowledges STOP and exits
+#define TAG_CACHED 5    // main server to itself: a job answered from the result cache
+#define TAG_FAILED 6    // main server to itself: a part given up after MAX_JOB_TIMEOUTS, or cancelled
+
+#define OP_STOP 0
+#define OP_PRIMES 1
+#define OP_PRIMEDIVISORS 2
+#define OP_ANAGRAMS 3
+#define OP_PRIMES_RANGE 4
+#define OP_CANCEL 5     // stop streaming the result of the dispatch with this ticket; takes no credit
+#define OP_COUNT 6
+
+#define POLICY_FIFO 0   // dispatch in file order
+#define POLICY_SJF 1    // shortest estimated job first
+#define POLICY_LPT 2    // longest estimated job first
+#define POLICY_DRR 3    // clients take turns, each dispatching about the same estimated work
+#define COST_LEARNING_RATE 0.2
+
+#define CACHE_PENDING 0         // the first copy of the command is running, later ones wait for it
+#define CACHE_READY 1
+#define CACHE_TOO_LARGE 2       // the result exceeds the per-entry limit, copies are computed again
+
+#define EVENT_RECEIVED 0        // job read from the command file
+#define EVENT_UNKNOWN 1         // job_id holds the line number of a command that was not understood
+#define EVENT_DISPATCHED 2      // peer is the worker, value the estimated service time in ms
+#define EVENT_CACHE_HIT 3
+#define EVENT_COALESCED 4
+#define EVENT_COMPLETED 5       // peer is the worker, value the measured service time in ms
+#define EVENT_ANSWERED 6        // peer is the job whose result answered this one
+#define EVENT_TIMED_OUT 7       // peer is the worker, value the time since dispatch in ms
+#define EVENT_RETRIED 8         // peer is the worker it left, value the dispatches so far
+#define EVENT_FAILED 9
+#define EVENT_EXCLUDED 10       // peer is the worker, no job
+#define EVENT_CANCELLED 11      // peer is the worker, value the time since dispatch in ms
+
+#define FAILED_TIMEOUTS 1       // never answered within its deadline, MAX_JOB_TIMEOUTS times
+#define FAILED_CANCELLED 2      // its answer stalled or ran past its deadline
+
+#define ADMIT_DISPATCH 0
+#define ADMIT_HIT 1
+#define ADMIT_COALESCED 2
 
 typedef struct 
 {
@@ -21,437 +110,4458 @@ typedef struct
 
 } WorkerResult;
 
+// commands and results travel as raw bytes and are sent and received at their
+// exact size; all ranks are assumed to share one architecture
+typedef struct
+{
+    int32_t opcode;
+    int32_t client_id;
+    int32_t job_id;             // entry in the main server's job table
+    uint32_t ticket;            // the dispatch carrying the command, echoed in its result
+    int64_t arg;                // N, or the low end of a range
+    int64_t arg2;               // the high end of a range
+    char word[MAX_WORD_LENGTH]; // OP_ANAGRAMS only, sent up to its terminator
+
+} Command;
+
+typedef struct
+{
+    int32_t client_id;
+    int32_t job_id;
+    uint32_t ticket;
+    int64_t value;                  // prime count of a TAG_PART reply, or the shared ring slot of a chunk
+    double service_ms;              // time the worker spent on the job, in the final message of a job
+    int32_t shared_length;          // text bytes of a chunk left in the shared ring instead of in text
+    int32_t shared_ring;            // which of the worker's rings, one per thread
+    char text[ANAGRAM_CHUNK_SIZE];  // sent up to its terminator
+
+} ResultMessage;
+
+typedef struct
+{
+    int *base_primes;           // odd primes from 11 up to base_limit
+    int base_count;
+    long long base_limit;
+    long long *checkpoints;     // checkpoints[k] = number of primes below k * SIEVE_SEGMENT_SPAN
+    int checkpoint_count;
+    int checkpoint_capacity;
+    uint64_t presieve[PRESIEVE_WORDS + 1];
+    pthread_rwlock_t base_lock;         // held for reading while base_primes is in use
+    pthread_mutex_t checkpoint_lock;
+
+} PrimeCache;
+
+// a finished result, keyed by the command without its client; the text is
+// exactly what follows the client line in the client file
+typedef struct CacheEntry
+{
+    int32_t opcode;
+    int64_t arg;
+    char word[MAX_WORD_LENGTH];
+    int state;
+    int waiters;                // first job waiting for a pending entry, linked through Job.next_waiter
+    int pins;                   // hits not yet written by the receiver; pinned entries are not evicted
+    unsigned bucket;
+    char *text;
+    size_t length;
+    struct CacheEntry *next;    // hash chain
+    struct CacheEntry *newer;   // LRU list, settled entries only
+    struct CacheEntry *older;
+
+} CacheEntry;
+
+typedef struct
+{
+    CacheEntry *buckets[RESULT_CACHE_BUCKETS];
+    CacheEntry *newest;
+    CacheEntry *oldest;
+    size_t bytes;
+    size_t budget;
+    int entries;
+    long hits;
+    long coalesced;
+    long misses;
+
+} ResultCache;
+
+// text of a streamed result collected for the cache, up to a limit
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t limit;
+    int overflow;
+
+} TextBuffer;
+
+// one result on its way to a client file. The results of a client are written
+// one at a time, in the order they began, so a stream never has other text in
+// the middle; the first writes straight through, the others hold their text
+// until their turn. Owned by the receive thread
+typedef struct ClientOutput
+{
+    struct ClientOutput *next;      // the client's next result
+    int client_id;
+    int done;                       // all of it has arrived
+    int dropped;                    // given up, nothing more of it is written
+    int direct;                     // its turn has come
+    TextBuffer held;
+
+} ClientOutput;
+
+typedef struct
+{
+    ClientOutput *head;
+    ClientOutput *tail;
+
+} OutputQueue;
+
+// a streamed result being received, found by the ticket of its dispatch;
+// chunks of different jobs arrive interleaved and are taken apart here
+typedef struct ResultStream
+{
+    struct ResultStream *next;
+    uint32_t ticket;
+    int live;                       // its dispatch is current, a stream given up is drained and dropped
+    ClientOutput *output;
+    TextBuffer capture;             // the text for the result cache
+
+} ResultStream;
+
+// a command read by the main server; large PRIMES jobs are scattered over
+// several workers as PRIMESRANGE parts and summed here
+typedef struct
+{
+    Command command;
+    char description[64];
+    uint64_t received_ns;       // arrival time, the scheduled one when replaying or generating load
+    uint64_t completed_ns;
+    double work;                // size in the units of the cost model, see job_work()
+    double service_ms;          // worker time of the parts completed so far
+    long long count;
+    int parts;
+    int parts_done;
+    CacheEntry *cache_entry;    // entry this job computes or is answered from
+    int next_waiter;
+    int failed;                 // FAILED_*, a part was given up and the client gets a failure
+
+} Job;
+
+// a job waiting for dispatch, with what the scheduler needs copied from the
+// job table, which it never reads
+typedef struct
+{
+    int job_id;
+    int opcode;
+    double work;
+
+} QueuedJob;
+
+// the waiting jobs of one client in one priority class, in arrival order
+typedef struct
+{
+    QueuedJob *jobs;
+    int head;
+    int count;
+    int capacity;
+    double deficit;             // estimated ms the client may still dispatch this round
+    int active;                 // in its class's round
+
+} ClientQueue;
+
+// the clients of a priority class with jobs waiting; under POLICY_DRR the
+// one at the front of the round dispatches while its deficit lasts
+typedef struct
+{
+    ClientQueue *queues;        // by client id
+    int queue_count;
+    int *round;                 // ring of client ids
+    int round_head;
+    int round_count;
+    int round_capacity;
+    int queued;
+
+} PriorityClass;
+
+// a command out on a worker until its result arrives or its deadline passes;
+// results are matched by ticket, so one from a dispatch given up is dropped
+typedef struct
+{
+    Command command;            // as sent, PRIMESRANGE parts included
+    uint32_t ticket;
+    int live;
+    int answering;              // its result has started arriving
+    int worker_id;
+    int part;
+    int attempts;               // dispatches of the command so far
+    int timeouts;
+    double estimate_ms;
+    uint64_t dispatched_ns;
+    uint64_t deadline_ns;       // sent again if not answering by then, cancelled if still answering
+    uint64_t progress_ns;       // an answering dispatch is cancelled if no chunk comes by then
+
+} Dispatch;
+
+typedef struct
+{
+    int strikes;                // jobs timed out on since its last result
+    int struck_job;             // the last of them, which strikes only once
+    int excluded;               // no more work, its credits are gone
+    int written_off;            // credits held by dispatches that timed out
+    int stopped;
+
+} WorkerHealth;
+
+// distinct permutations of a word in lexicographic order, produced on demand
+typedef struct
+{
+    char letters[MAX_WORD_LENGTH];
+    int length;
+    int done;
+
+} AnagramStream;
+
+// bytes bound for a client file, queued by the receive thread for the writer
+typedef struct ClientWrite
+{
+    struct ClientWrite *next;
+    int client_id;
+    uint64_t queued_ns;
+    size_t length;
+    char data[];
+
+} ClientWrite;
+
+typedef struct
+{
+    ClientWrite *head;
+    ClientWrite *tail;
+    size_t bytes;
+    struct timespec flush_by;   // WRITE_FLUSH_MS after the oldest queued write, CLOCK_REALTIME
+    int stopping;
+    long written;               // writes done, and their time from queue to file; owned by the writer
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+
+} WriteQueue;
+
+// a client file held open by the writer
+typedef struct
+{
+    int client_id;
+    int fd;
+    unsigned long last_used;
+
+} ClientFile;
+
+// one entry of the dispatcher log; the binary log is a plain array of these
+typedef struct
+{
+    uint64_t ns;                // CLOCK_MONOTONIC
+    int16_t type;
+    int16_t part;               // PRIMESRANGE part of a dispatched job
+    int32_t job_id;
+    int32_t peer;
+    double value;
+
+} LogEvent;
+
+// events of one thread on their way to the log thread; the owner only moves
+// head and the log thread only moves tail, so neither ever waits
+typedef struct EventRing
+{
+    LogEvent events[EVENT_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;           // events lost to a full ring
+    struct EventRing *next;
+
+} EventRing;
+
+// a newline-framed command stream; lines longer than the buffer are dropped
+typedef struct
+{
+    int fd;
+    size_t used;
+    int overlong;
+    char data[BUFFER_SIZE];
+
+} LineReader;
+
+// commands a worker rank has received and not yet started, shared by its threads
+typedef struct
+{
+    Command *commands;
+    int head;
+    int count;
+    int capacity;
+    int stopping;
+    int started;                    // threads so far, each taking the next shared ring
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+
+} WorkQueue;
+
+// the command file run by threads of one process, for single-node deployments;
+// each thread claims the next command with an atomic increment
+typedef struct
+{
+    Command *commands;
+    int count;
+    int capacity;
+    int next;
+    int threads;
+    pthread_mutex_t output_lock;    // guards the client output queues, taken per chunk
+
+} LocalRun;
+
+// anagram chunks of one worker thread in the shared window, for ranks on one
+// node: the thread fills slots in order and sends only their number, the main
+// server frees them by moving tail on. One producer, the thread, and one
+// consumer, the receive thread
+typedef struct
+{
+    uint64_t tail;                  // slots the main server is done with
+    char padding[56];               // keeps the worker's writes off the line the main server writes
+    char slots[SHARED_RING_SLOTS][ANAGRAM_CHUNK_SIZE];
+
+} SharedRing;
+
 pthread_mutex_t lock;
-int available_workers[MAX_WORKERS];
+// the credits have a lock of their own, taken inside lock when both are
+// needed, so waiting for or handing back a credit never waits for the job table
+pthread_mutex_t credit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t worker_freed = PTHREAD_COND_INITIALIZER;
+int *free_workers;              // ring of worker credits, one entry per free queue slot, guarded by credit_lock
+int free_head;
+int free_count;
+int free_capacity;
+int prefetch_depth = PREFETCH_DEPTH;
+int live_credits;               // credits of the workers still in service, less those written off; credit_lock
+int live_workers;
+WorkerHealth *worker_health;    // guarded by lock, like the dispatches and retries; excluded is set under credit_lock too
+Dispatch *dispatches;           // a ticket's slot is ticket % dispatch_capacity
+int dispatch_capacity;
+int *free_slots;
+int free_slot_count;
+int in_flight;                  // live dispatches, and given up ones not yet answered; atomic
+int deadline_min_ms = DEADLINE_MIN_MS;
+int timed_out_count;
+int retried_count;
+int failed_count;
+int cancelled_count;
+int abandoned_workers;          // workers given up for hung at the end
+int watchdog_stopping;
+pthread_cond_t watchdog_wake = PTHREAD_COND_INITIALIZER;
+int worker_threads;             // threads per worker rank; 0 picks one per core of the node
+int *worker_capacity;           // threads of each worker rank, gathered by the main server
+int total_worker_threads;
 int num_workers;
+int benchmark_jobs;             // commands to generate and time, 0 runs the given commands
+char *benchmark_mix = "4:4:2";  // relative weights of PRIMES, PRIMEDIVISORS and ANAGRAMS
+int benchmark_log_sizes;        // draw sizes log-uniformly instead of uniformly
+double serial_seconds;
+double cluster_seconds;
+int local_mode;                 // run the commands on a thread pool instead of the cluster
+LocalRun local_run = { .output_lock = PTHREAD_MUTEX_INITIALIZER };
+double local_seconds;
+double *worker_busy_ms;         // service time reported by each worker, owned by the receive thread
+int dispatched_jobs;            // dispatcher statistics, owned by the send thread
+double dispatch_ms;
+double credit_wait_ms;
 FILE *log_file;
+int binary_log;
+int log_stopping;
+uint64_t log_epoch_ns;
+EventRing *event_rings;         // every ring ever registered, guarded by ring_lock
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local EventRing *thread_ring;
+PrimeCache prime_cache = { .base_lock = PTHREAD_RWLOCK_INITIALIZER, .checkpoint_lock = PTHREAD_MUTEX_INITIALIZER };
+_Thread_local uint64_t sieve_buffer[SIEVE_SEGMENT_WORDS];  // one segment per worker thread
+int shared_transport;           // stream anagram chunks through shared memory
+MPI_Win shared_window = MPI_WIN_NULL;
+SharedRing *worker_rings;       // a worker's rings, one per thread
+_Thread_local SharedRing *shared_ring;  // the ring of this worker thread, NULL when chunks go by message
+_Thread_local uint64_t shared_head;     // slots it has filled
+SharedRing **shared_rings;      // the main server's view of each worker's rings
+uint32_t cancelled_tickets[CANCELLED_TICKETS];  // a worker's latest OP_CANCELs, atomic
+int cancelled_next;
+Job *jobs;                      // guarded by lock, like everything below
+int job_count;
+int job_capacity;
+int coalesced_count;            // jobs waiting for an identical job in flight, atomic
+int input_done;                 // atomic
+char *input_path = INPUT_FILE;  // a file, a named pipe, "-" for stdin or "unix:PATH" for a socket
+int line_number;                // commands read so far, for the log
+ResultCache result_cache = { .budget = (size_t)RESULT_CACHE_MB << 20 };
+int schedule_policy = POLICY_DRR;
+int replay_trace;               // honor WAIT lines instead of skipping them
+double arrival_rate;            // jobs per second of the generated open-loop load, 0 reads the file as is
+int generated_jobs;
+// estimated seconds per unit of work for each opcode, on top of a fixed
+// overhead in seconds per job, both refined from measured service times;
+// PRIMESRANGE parts are accounted to their PRIMES job. Read and written
+// atomically, the scheduler not holding lock
+double cost_per_unit[OP_COUNT] = { 0, 2.5e-10, 3e-9, 5e-9, 0 };
+double cost_overhead[OP_COUNT] = { 0, 5e-5, 5e-5, 5e-5, 0 };
+// the scheduler has a lock of its own, so choosing a job never waits for the
+// job table, the cache or the receiver
+pthread_mutex_t schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t job_taken = PTHREAD_COND_INITIALIZER;
+PriorityClass priority_classes[PRIORITY_CLASSES];  // guarded by schedule_lock, like the retries
+int queued_jobs;
+Dispatch *retries;              // ring of commands to send again, ahead of new jobs
+int retry_head;
+int retry_count;
+int command_class[OP_COUNT];    // priority class of each opcode
+WriteQueue client_writes = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .space = PTHREAD_COND_INITIALIZER };
+ClientFile client_files[CLIENT_FD_LIMIT];   // owned by the writer thread
+int client_file_count;
+char (*client_names)[32];
+int client_count;
+int client_capacity;
+OutputQueue *output_queues;     // by client id, owned by the receive thread or, in local mode, guarded by local_run.output_lock
+int output_queue_count;
 
 
+// every worker starts with threads * prefetch_depth credits; the ring is filled
+// round by round so each worker gets a job before any worker gets a second one
 void initialize_workers() 
 {
-    for (int i = 0; i < MAX_WORKERS; i++) 
+    free_capacity = 0;
+    total_worker_threads = 0;
+    for (int i = 1; i <= num_workers; i++) 
+    {
+        total_worker_threads += worker_capacity[i];
+        free_capacity += worker_capacity[i] * prefetch_depth;
+    }
+    free_workers = (int*) malloc(free_capacity * sizeof(int));
+    worker_busy_ms = (double*) calloc(num_workers + 1, sizeof(double));
+    worker_health = (WorkerHealth*) calloc(num_workers + 1, sizeof(WorkerHealth));
+    if (!free_workers || !worker_busy_ms || !worker_health) 
+    {
+        perror("failed to allocate memory for worker credits");
+        exit(EXIT_FAILURE);
+    }
+    live_credits = free_capacity;
+    live_workers = num_workers;
+
+    // every dispatch holds a credit, so there are never more of them
+    dispatch_capacity = free_capacity;
+    dispatches = (Dispatch*) calloc(dispatch_capacity, sizeof(Dispatch));
+    retries = (Dispatch*) malloc(dispatch_capacity * sizeof(Dispatch));
+    free_slots = (int*) malloc(dispatch_capacity * sizeof(int));
+    if (!dispatches || !retries || !free_slots) 
+    {
+        perror("failed to allocate memory for dispatches");
+        exit(EXIT_FAILURE);
+    }
+    for (int slot = 0; slot < dispatch_capacity; slot++) 
+    {
+        dispatches[slot].ticket = slot;
+        free_slots[slot] = slot;
+    }
+    free_slot_count = dispatch_capacity;
+
+    free_head = 0;
+    free_count = 0;
+    for (int round = 0; free_count < free_capacity; round++) 
+    {
+        for (int i = 1; i <= num_workers; i++) 
+        {
+            if (round < worker_capacity[i] * prefetch_depth) 
+            {
+                free_workers[free_count++] = i;
+            }
+        }
+    }
+}
+
+// takes one credit of some worker still in service; blocks until the
+// receiver hands one back
+int acquire_worker() 
+{
+    pthread_mutex_lock(&credit_lock);
+    while (free_count == 0) 
+    {
+        pthread_cond_wait(&worker_freed, &credit_lock);
+    }
+    int worker_id = free_workers[free_head];
+    free_head = (free_head + 1) % free_capacity;
+    free_count--;
+    pthread_mutex_unlock(&credit_lock);
+
+    return worker_id;
+}
+
+// hands a credit back; those of excluded workers are dropped. Called with
+// credit_lock held
+void return_credit(int worker_id) 
+{
+    if (!worker_health[worker_id].excluded) 
+    {
+        free_workers[(free_head + free_count) % free_capacity] = worker_id;
+        free_count++;
+        pthread_cond_signal(&worker_freed);
+    }
+}
+
+void release_worker(int worker_id) 
+{
+    pthread_mutex_lock(&credit_lock);
+    return_credit(worker_id);
+    pthread_mutex_unlock(&credit_lock);
+}
+
+// a credit held by a dispatch given up stays out of the ring until a late
+// result brings it back; called with lock held
+void write_off_credit(int worker_id) 
+{
+    worker_health[worker_id].written_off++;
+    pthread_mutex_lock(&credit_lock);
+    live_credits--;
+    pthread_cond_broadcast(&worker_freed);
+    pthread_mutex_unlock(&credit_lock);
+}
+
+// trades a credit of the worker a retry timed out on for a free one of
+// another worker, when there is one, so a bad command moves on
+int avoid_worker(int worker_id, int avoided) 
+{
+    pthread_mutex_lock(&credit_lock);
+    if (worker_id == avoided && !worker_health[worker_id].excluded) 
+    {
+        for (int i = 0; i < free_count; i++) 
+        {
+            int *credit = &free_workers[(free_head + i) % free_capacity];
+            if (*credit != avoided) 
+            {
+                worker_id = *credit;
+                *credit = avoided;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&credit_lock);
+
+    return worker_id;
+}
+
+void wait_for_all_workers() 
+{
+    pthread_mutex_lock(&credit_lock);
+    while (free_count < live_credits) 
+    {
+        pthread_cond_wait(&worker_freed, &credit_lock);
+    }
+    pthread_mutex_unlock(&credit_lock);
+}
+
+// wakes the send thread after a change to what next_job() waits on; the
+// change itself is made before, under whichever lock guards it
+void wake_scheduler() 
+{
+    pthread_mutex_lock(&schedule_lock);
+    pthread_cond_broadcast(&job_queued);
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+// queues a job behind the others of its client and class; called with
+// schedule_lock held, and with lock if job is in the job table
+void schedule_job(Job *job) 
+{
+    PriorityClass *class = &priority_classes[command_class[job->command.opcode]];
+    int client_id = job->command.client_id;
+    if (client_id >= class->queue_count) 
+    {
+        int queue_count = class->queue_count ? 2 * class->queue_count : 16;
+        while (queue_count <= client_id) 
+        {
+            queue_count *= 2;
+        }
+        class->queues = (ClientQueue*) realloc(class->queues, queue_count * sizeof(ClientQueue));
+        if (!class->queues) 
+        {
+            perror("failed to allocate memory for client queues");
+            exit(EXIT_FAILURE);
+        }
+        memset(&class->queues[class->queue_count], 0, (queue_count - class->queue_count) * sizeof(ClientQueue));
+
+        // the round is a ring, so its live part moves to the new size unwrapped
+        int *round = (int*) malloc(queue_count * sizeof(int));
+        if (!round) 
+        {
+            perror("failed to allocate memory for client queues");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < class->round_count; i++) 
+        {
+            round[i] = class->round[(class->round_head + i) % class->round_capacity];
+        }
+        free(class->round);
+        class->round = round;
+        class->round_head = 0;
+        class->round_capacity = queue_count;
+        class->queue_count = queue_count;
+    }
+
+    ClientQueue *queue = &class->queues[client_id];
+    if (queue->head + queue->count == queue->capacity) 
+    {
+        if (queue->head > 0) 
+        {
+            memmove(queue->jobs, &queue->jobs[queue->head], queue->count * sizeof(QueuedJob));
+            queue->head = 0;
+        }
+        else 
+        {
+            queue->capacity = queue->capacity ? 2 * queue->capacity : 16;
+            queue->jobs = (QueuedJob*) realloc(queue->jobs, queue->capacity * sizeof(QueuedJob));
+            if (!queue->jobs) 
+            {
+                perror("failed to allocate memory for client queues");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    queue->jobs[queue->head + queue->count++] = (QueuedJob) { job->command.job_id, job->command.opcode, job->work };
+
+    if (!queue->active) 
+    {
+        queue->active = 1;
+        class->round[(class->round_head + class->round_count) % class->round_capacity] = client_id;
+        class->round_count++;
+    }
+    class->queued++;
+    queued_jobs++;
+    pthread_cond_signal(&job_queued);
+}
+
+uint64_t monotonic_ns() 
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+double elapsed_ms(struct timespec *since) 
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// grows the base primes to cover limit; callers then take base_lock for
+// reading, and a later growth by another thread only extends the table
+void ensure_base_primes(long long limit)
+{
+    pthread_rwlock_rdlock(&prime_cache.base_lock);
+    int covered = limit <= prime_cache.base_limit;
+    pthread_rwlock_unlock(&prime_cache.base_lock);
+    if (covered)
+    {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&prime_cache.base_lock);
+    if (limit <= prime_cache.base_limit)
+    {
+        pthread_rwlock_unlock(&prime_cache.base_lock);
+        return;
+    }
+
+    if (prime_cache.base_limit == 0)
+    {
+        // bit b of the pattern stands for the odd number 2b + 1
+        for (int b = 0; b < PRESIEVE_WORDS * 64; b++)
+        {
+            int n = 2 * b + 1;
+            if (n % 3 == 0 || n % 5 == 0 || n % 7 == 0)
+            {
+                prime_cache.presieve[b / 64] |= 1ULL << (b % 64);
+            }
+        }
+        prime_cache.presieve[PRESIEVE_WORDS] = prime_cache.presieve[0];
+    }
+
+    long long new_limit = prime_cache.base_limit * 2;
+    if (new_limit < limit)
+    {
+        new_limit = limit;
+    }
+    if (new_limit < 1024)
+    {
+        new_limit = 1024;
+    }
+
+    char *composite = (char*) calloc(new_limit + 1, 1);
+    int *primes = (int*) realloc(prime_cache.base_primes, (new_limit / 2 + 1) * sizeof(int));
+    if (!composite || !primes)
+    {
+        perror("fail allocating base primes");
+        exit(EXIT_FAILURE);
+    }
+
+    int count = 0;
+    for (long long i = 3; i <= new_limit; i += 2)
+    {
+        if (composite[i])
+        {
+            continue;
+        }
+        if (i >= 11)
+        {
+            primes[count++] = i;
+        }
+        for (long long j = i * i; j <= new_limit; j += 2 * i)
+        {
+            composite[j] = 1;
+        }
+    }
+    free(composite);
+
+    prime_cache.base_primes = primes;
+    prime_cache.base_count = count;
+    prime_cache.base_limit = new_limit;
+    pthread_rwlock_unlock(&prime_cache.base_lock);
+}
+
+// primes in [low, high) with high - low <= SIEVE_SEGMENT_SPAN; called with
+// base_lock held for reading
+long long sieve_segment(long long low, long long high)
+{
+    uint64_t *segment = sieve_buffer;
+    long long count = 0;
+
+    if (low <= 2 && 2 < high)
+    {
+        count++;
+    }
+
+    long long first = low | 1;
+    if (first >= high)
+    {
+        return count;
+    }
+    long long bits = (high - first + 1) / 2;
+    int words = (bits + 63) / 64;
+
+    // copy the 3-5-7 wheel in, starting at the bit that matches first
+    long long offset = ((first - 1) / 2) % (PRESIEVE_WORDS * 64);
+    int q = offset / 64;
+    int r = offset % 64;
+    for (int w = 0; w < words; w++)
+    {
+        segment[w] = r ? (prime_cache.presieve[q] >> r) | (prime_cache.presieve[q + 1] << (64 - r)) : prime_cache.presieve[q];
+        if (++q == PRESIEVE_WORDS)
+        {
+            q = 0;
+        }
+    }
+    for (int p = 3; p <= 7; p += 2)
+    {
+        if (p >= first && p < high)
+        {
+            long long j = (p - first) / 2;
+            segment[j / 64] &= ~(1ULL << (j % 64));
+        }
+    }
+    if (first == 1)
+    {
+        segment[0] |= 1;
+    }
+
+    for (int k = 0; k < prime_cache.base_count; k++)
+    {
+        long long p = prime_cache.base_primes[k];
+        if (p * p >= high)
+        {
+            break;
+        }
+
+        long long m = p * p;
+        if (m < first)
+        {
+            m = ((first + p - 1) / p) * p;
+            if ((m & 1) == 0)
+            {
+                m += p;
+            }
+        }
+        for (long long j = (m - first) / 2; j < bits; j += p)
+        {
+            segment[j / 64] |= 1ULL << (j % 64);
+        }
+    }
+
+    long long marked = 0;
+    for (int w = 0; w < words - 1; w++)
     {
-        available_workers[i] = 1;
+        marked += __builtin_popcountll(segment[w]);
     }
+    int tail = bits - (long long)(words - 1) * 64;
+    uint64_t mask = (tail == 64) ? ~0ULL : ((1ULL << tail) - 1);
+    marked += __builtin_popcountll(segment[words - 1] & mask);
+
+    return count + bits - marked;
 }
 
-int is_prime(int num) 
+// primes in [low, high), sieved one cache-sized segment at a time
+long long count_primes_range(long long low, long long high)
 {
-    if (num <= 1) 
+    if (high <= low)
     {
         return 0;
     }
-    for (int i = 2; i <= sqrt(num); i++) 
+    ensure_base_primes((long long)sqrt((double)high) + 1);
+
+    long long count = 0;
+    pthread_rwlock_rdlock(&prime_cache.base_lock);
+    for (long long seg_low = low; seg_low < high; seg_low += SIEVE_SEGMENT_SPAN)
+    {
+        long long seg_high = seg_low + SIEVE_SEGMENT_SPAN < high ? seg_low + SIEVE_SEGMENT_SPAN : high;
+        count += sieve_segment(seg_low, seg_high);
+    }
+    pthread_rwlock_unlock(&prime_cache.base_lock);
+    return count;
+}
+
+// pi(limit - 1); full segments come from the checkpoint cache, which grows
+// as needed, so repeated or nearby queries only sieve the last segment
+long long count_primes_below(long long limit)
+{
+    long long full = limit / SIEVE_SEGMENT_SPAN;
+
+    pthread_mutex_lock(&prime_cache.checkpoint_lock);
+    if (prime_cache.checkpoint_count == 0)
     {
-        if (num % i == 0)
+        prime_cache.checkpoint_capacity = 64;
+        prime_cache.checkpoints = (long long*) malloc(prime_cache.checkpoint_capacity * sizeof(long long));
+        if (!prime_cache.checkpoints)
         {
-            return 0;
+            perror("fail allocating prime checkpoints");
+            exit(EXIT_FAILURE);
         }
+        prime_cache.checkpoints[0] = 0;
+        prime_cache.checkpoint_count = 1;
+    }
+
+    while (prime_cache.checkpoint_count <= full)
+    {
+        if (prime_cache.checkpoint_count == prime_cache.checkpoint_capacity)
+        {
+            prime_cache.checkpoint_capacity *= 2;
+            prime_cache.checkpoints = (long long*) realloc(prime_cache.checkpoints, prime_cache.checkpoint_capacity * sizeof(long long));
+            if (!prime_cache.checkpoints)
+            {
+                perror("fail reallocating prime checkpoints");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        long long k = prime_cache.checkpoint_count - 1;
+        prime_cache.checkpoints[k + 1] = prime_cache.checkpoints[k] + count_primes_range(k * SIEVE_SEGMENT_SPAN, (k + 1) * SIEVE_SEGMENT_SPAN);
+        prime_cache.checkpoint_count++;
+    }
+
+    long long below = prime_cache.checkpoints[full];
+    pthread_mutex_unlock(&prime_cache.checkpoint_lock);
+
+    return below + count_primes_range(full * SIEVE_SEGMENT_SPAN, limit);
+}
+
+long long count_primes(long long n) 
+{
+    if (n < 2)
+    {
+        return 0;
+    }
+    return count_primes_below(n + 1);
+}
+
+// forgets the base primes and checkpoints, so a run after the baseline
+// starts as cold as the baseline did
+void reset_prime_cache()
+{
+    pthread_mutex_lock(&prime_cache.checkpoint_lock);
+    pthread_rwlock_wrlock(&prime_cache.base_lock);
+    free(prime_cache.base_primes);
+    free(prime_cache.checkpoints);
+    prime_cache.base_primes = NULL;
+    prime_cache.checkpoints = NULL;
+    prime_cache.base_count = 0;
+    prime_cache.base_limit = 0;
+    prime_cache.checkpoint_count = 0;
+    prime_cache.checkpoint_capacity = 0;
+    pthread_rwlock_unlock(&prime_cache.base_lock);
+    pthread_mutex_unlock(&prime_cache.checkpoint_lock);
+}
+
+uint64_t mul_mod(uint64_t a, uint64_t b, uint64_t m) 
+{
+    return (unsigned __int128)a * b % m;
+}
+
+uint64_t pow_mod(uint64_t base, uint64_t exp, uint64_t m) 
+{
+    uint64_t result = 1;
+    base %= m;
+    while (exp) 
+    {
+        if (exp & 1) 
+        {
+            result = mul_mod(result, base, m);
+        }
+        base = mul_mod(base, base, m);
+        exp >>= 1;
+    }
+    return result;
+}
+
+uint64_t gcd_u64(uint64_t a, uint64_t b) 
+{
+    while (b) 
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Miller-Rabin; the first twelve primes as bases are deterministic for 64-bit n
+int is_prime_u64(uint64_t n) 
+{
+    static const uint64_t bases[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+
+    if (n < 2) 
+    {
+        return 0;
+    }
+    for (int i = 0; i < 12; i++) 
+    {
+        if (n % bases[i] == 0) 
+        {
+            return n == bases[i];
+        }
+    }
+
+    uint64_t d = n - 1;
+    int s = 0;
+    while ((d & 1) == 0) 
+    {
+        d >>= 1;
+        s++;
+    }
+
+    for (int i = 0; i < 12; i++) 
+    {
+        uint64_t x = pow_mod(bases[i], d, n);
+        if (x == 1 || x == n - 1) 
+        {
+            continue;
+        }
+        int witness = 1;
+        for (int r = 1; r < s; r++) 
+        {
+            x = mul_mod(x, x, n);
+            if (x == n - 1) 
+            {
+                witness = 0;
+                break;
+            }
+        }
+        if (witness) 
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Pollard-Rho with Brent's cycle detection; n must be odd and composite
+uint64_t pollard_rho(uint64_t n) 
+{
+    for (uint64_t c = 1; ; c++) 
+    {
+        uint64_t x = 0, y = 2, ys = 2, q = 1, g = 1;
+        long long r = 1;
+
+        do 
+        {
+            x = y;
+            for (long long i = 0; i < r; i++) 
+            {
+                y = ((unsigned __int128)mul_mod(y, y, n) + c) % n;
+            }
+            for (long long k = 0; k < r && g == 1; k += 128) 
+            {
+                ys = y;
+                for (long long i = 0; i < 128 && i < r - k; i++) 
+                {
+                    y = ((unsigned __int128)mul_mod(y, y, n) + c) % n;
+                    q = mul_mod(q, x > y ? x - y : y - x, n);
+                }
+                g = gcd_u64(q, n);
+            }
+            r *= 2;
+        } while (g == 1);
+
+        if (g == n) 
+        {
+            // the batched product overshot, redo the last batch one step at a time
+            do 
+            {
+                ys = ((unsigned __int128)mul_mod(ys, ys, n) + c) % n;
+                g = gcd_u64(x > ys ? x - ys : ys - x, n);
+            } while (g == 1);
+        }
+        if (g != n) 
+        {
+            return g;
+        }
+    }
+}
+
+void collect_large_factors(uint64_t n, uint64_t *factors, int *count) 
+{
+    if (n == 1) 
+    {
+        return;
+    }
+    if (is_prime_u64(n)) 
+    {
+        factors[(*count)++] = n;
+        return;
+    }
+    uint64_t d = pollard_rho(n);
+    collect_large_factors(d, factors, count);
+    collect_large_factors(n / d, factors, count);
+}
+
+// trial division by the cached prime table up to TRIAL_DIVISION_LIMIT, then
+// Pollard-Rho for whatever is left; counts distinct prime divisors
+int count_prime_divisors(uint64_t n) 
+{
+    int count = 0;
+    if (n < 2) 
+    {
+        return 0;
+    }
+
+    for (uint64_t p = 2; p <= 7; p += (p == 2) ? 1 : 2) 
+    {
+        if (n % p == 0) 
+        {
+            count++;
+            while (n % p == 0) 
+            {
+                n /= p;
+            }
+        }
+    }
+
+    ensure_base_primes(TRIAL_DIVISION_LIMIT);
+    pthread_rwlock_rdlock(&prime_cache.base_lock);
+    for (int k = 0; k < prime_cache.base_count; k++) 
+    {
+        uint64_t p = prime_cache.base_primes[k];
+        if (p > TRIAL_DIVISION_LIMIT || p * p > n) 
+        {
+            break;
+        }
+        if (n % p == 0) 
+        {
+            count++;
+            while (n % p == 0) 
+            {
+                n /= p;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&prime_cache.base_lock);
+
+    if (n == 1) 
+    {
+        return count;
+    }
+    if (n < (uint64_t)TRIAL_DIVISION_LIMIT * TRIAL_DIVISION_LIMIT) 
+    {
+        return count + 1;
+    }
+
+    // every factor left is above TRIAL_DIVISION_LIMIT, so there are at most three
+    uint64_t factors[64];
+    int found = 0;
+    collect_large_factors(n, factors, &found);
+    for (int i = 0; i < found; i++) 
+    {
+        int seen = 0;
+        for (int j = 0; j < i; j++) 
+        {
+            if (factors[j] == factors[i]) 
+            {
+                seen = 1;
+                break;
+            }
+        }
+        count += !seen;
+    }
+    return count;
+}
+
+// PRIMEDIVISORS takes any 64-bit N; negative input has no prime divisors
+uint64_t parse_u64(char *param) 
+{
+    return (param[0] == '-') ? 0 : strtoull(param, NULL, 10);
+}
+
+// the bytes ANAGRAMS word writes: its distinct permutations, one per line
+double anagram_bytes(char *word) 
+{
+    int counts[256] = {0};
+    int length = strnlen(word, MAX_WORD_LENGTH - 1);
+    double permutations = 1;
+    for (int i = 0; i < length; i++) 
+    {
+        permutations *= i + 1;
+        permutations /= ++counts[(unsigned char)word[i]];
+    }
+    return permutations * (length + 1);
+}
+
+void anagram_stream_init(AnagramStream *stream, char *word) 
+{
+    stream->length = strlen(word);
+    if (stream->length >= MAX_WORD_LENGTH) 
+    {
+        stream->length = MAX_WORD_LENGTH - 1;
+    }
+    memcpy(stream->letters, word, stream->length);
+    stream->letters[stream->length] = '\0';
+
+    // sorting first makes next_permutation visit every distinct arrangement once
+    for (int i = 1; i < stream->length; i++) 
+    {
+        char c = stream->letters[i];
+        int j = i - 1;
+        while (j >= 0 && stream->letters[j] > c) 
+        {
+            stream->letters[j + 1] = stream->letters[j];
+            j--;
+        }
+        stream->letters[j + 1] = c;
+    }
+    stream->done = 0;
+}
+
+int next_permutation(char *letters, int length) 
+{
+    int i = length - 2;
+    while (i >= 0 && letters[i] >= letters[i + 1]) 
+    {
+        i--;
+    }
+    if (i < 0) 
+    {
+        return 0;
+    }
+
+    int j = length - 1;
+    while (letters[j] <= letters[i]) 
+    {
+        j--;
+    }
+    char temp = letters[i];
+    letters[i] = letters[j];
+    letters[j] = temp;
+
+    for (int a = i + 1, b = length - 1; a < b; a++, b--) 
+    {
+        temp = letters[a];
+        letters[a] = letters[b];
+        letters[b] = temp;
+    }
+    return 1;
+}
+
+// writes as many whole "anagram\n" lines as fit in buffer (NUL-terminated)
+// and returns the number of bytes written
+int anagram_stream_fill(AnagramStream *stream, char *buffer, int capacity) 
+{
+    int used = 0;
+
+    while (!stream->done && used + stream->length + 2 <= capacity) 
+    {
+        memcpy(buffer + used, stream->letters, stream->length);
+        used += stream->length;
+        buffer[used++] = '\n';
+
+        if (!next_permutation(stream->letters, stream->length)) 
+        {
+            stream->done = 1;
+        }
+    }
+    buffer[used] = '\0';
+
+    return used;
+}
+
+int result_length(ResultMessage *result) 
+{
+    return offsetof(ResultMessage, text) + strlen(result->text) + 1;
+}
+
+// where the next chunk is written: the message itself, or the next slot of
+// the shared ring once the main server has freed it
+char *next_chunk(ResultMessage *result) 
+{
+    if (!shared_ring) 
+    {
+        return result->text;
+    }
+
+    struct timespec pause = { 0, 100000 };
+    while (shared_head - __atomic_load_n(&shared_ring->tail, __ATOMIC_ACQUIRE) == SHARED_RING_SLOTS) 
+    {
+        nanosleep(&pause, NULL);
+    }
+    return shared_ring->slots[shared_head % SHARED_RING_SLOTS];
+}
+
+// a chunk in the ring goes as a descriptor: the header with its slot and length
+void send_chunk(ResultMessage *result, int length) 
+{
+    if (!shared_ring) 
+    {
+        MPI_Send(result, result_length(result), MPI_BYTE, 0, TAG_CHUNK, MPI_COMM_WORLD);
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    result->value = shared_head++;
+    result->shared_length = length;
+    result->shared_ring = shared_ring - worker_rings;
+    MPI_Send(result, offsetof(ResultMessage, text), MPI_BYTE, 0, TAG_CHUNK, MPI_COMM_WORLD);
+}
+
+// whether the main server cancelled the dispatch with this ticket; tickets
+// are never 0
+int ticket_cancelled(uint32_t ticket) 
+{
+    for (int i = 0; i < CANCELLED_TICKETS; i++) 
+    {
+        if (__atomic_load_n(&cancelled_tickets[i], __ATOMIC_RELAXED) == ticket) 
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// sends the anagrams of word as TAG_CHUNK messages of at most
+// ANAGRAM_CHUNK_SIZE bytes of text followed by an empty one, so memory stays
+// bounded; every chunk carries the ticket of its dispatch, so the threads of
+// a worker stream side by side and the main server takes the streams apart.
+// A cancelled stream ends early
+void stream_anagrams(char *word, ResultMessage *result, struct timespec *started) 
+{
+    AnagramStream stream;
+    anagram_stream_init(&stream, word);
+
+    char *chunk = next_chunk(result);
+    int length = snprintf(chunk, ANAGRAM_CHUNK_SIZE, "Anagrams of %s are: ", word);
+    while (1) 
+    {
+        length += anagram_stream_fill(&stream, chunk + length, ANAGRAM_CHUNK_SIZE - length);
+        if (stream.done && length + 2 <= ANAGRAM_CHUNK_SIZE) 
+        {
+            chunk[length++] = '\n';
+            chunk[length] = '\0';
+            send_chunk(result, length);
+            break;
+        }
+        send_chunk(result, length);
+        if (ticket_cancelled(result->ticket)) 
+        {
+            break;
+        }
+        chunk = next_chunk(result);
+        length = 0;
+    }
+
+    result->value = 0;
+    result->shared_length = 0;
+    result->service_ms = elapsed_ms(started);
+    MPI_Send(result, offsetof(ResultMessage, text), MPI_BYTE, 0, TAG_CHUNK, MPI_COMM_WORLD);
+}
+
+// the pause of a "WAIT seconds" line, fractions allowed; -1 for other lines
+double wait_seconds(char *line) 
+{
+    if (strncmp(line, "WAIT", 4) != 0) 
+    {
+        return -1;
+    }
+    double seconds = atof(line + 4);
+    return seconds > 0 ? seconds : 0;
+}
+
+// sleeps until the monotonic time target and returns it
+uint64_t sleep_until(uint64_t target_ns) 
+{
+    struct timespec target = { (time_t)(target_ns / 1000000000ULL), (long)(target_ns % 1000000000ULL) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR) 
+    {
+    }
+    return target_ns;
+}
+
+void compute_serial() 
+{
+    FILE *commandsFile = fopen(input_path, "r");
+    if (commandsFile == NULL) 
+    {
+        perror("failed to open commands file serial");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *logFile = fopen(LOG_FILE_S, "w");
+    if (logFile == NULL) 
+    {
+        perror("failed to open log file serial");
+        fclose(commandsFile);
+        exit(EXIT_FAILURE);
+    }
+
+    char buffer[BUFFER_SIZE];
+    while (fgets(buffer, sizeof(buffer), commandsFile)) 
+    {
+        double wait = wait_seconds(buffer);
+        if (wait >= 0) 
+        {
+            if (replay_trace) 
+            {
+                sleep_until(monotonic_ns() + (uint64_t)(wait * 1e9));
+            }
+            continue;
+        } 
+
+        char client[32], task[32], param[32];
+        sscanf(buffer, "%s %s %s", client, task, param);
+
+        if (strcmp(task, "PRIMES") == 0) 
+        {
+            long long n = atoll(param);
+            long long count = count_primes(n);
+            fprintf(logFile, "Found %lld primes in the first %lld numbers.\n", count, n);
+            fflush(logFile);
+        } 
+        else if (strcmp(task, "PRIMEDIVISORS") == 0) 
+        {
+            uint64_t n = parse_u64(param);
+            int count = count_prime_divisors(n);
+            fprintf(logFile, "Found %d prime divisors of %llu.\n", count, (unsigned long long)n);
+            fflush(logFile);
+        } 
+        else if (strcmp(task, "ANAGRAMS") == 0 && anagram_bytes(param) > ANAGRAM_OUTPUT_LIMIT) 
+        {
+            fprintf(logFile, "Too many anagrams of %s to list, the limit is %lld MB.\n", param, ANAGRAM_OUTPUT_LIMIT >> 20);
+            fflush(logFile);
+        } 
+        else if (strcmp(task, "ANAGRAMS") == 0) 
+        {
+            AnagramStream stream;
+            anagram_stream_init(&stream, param);
+            fprintf(logFile, "Anagrams of %s are: ", param);
+            while (!stream.done) 
+            {
+                int length = anagram_stream_fill(&stream, buffer, sizeof(buffer));
+                fwrite(buffer, 1, length, logFile);
+            }
+            fprintf(logFile, "\n");
+            fflush(logFile);
+        } 
+        else 
+        {
+            fprintf(logFile, "Unknown command: %s", task);
+            fflush(logFile);
+        }
+    }
+
+    fclose(commandsFile);
+    fclose(logFile);
+}
+
+
+int client_id_for(char *name) 
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < client_count; i++) 
+    {
+        if (strcmp(client_names[i], name) == 0) 
+        {
+            pthread_mutex_unlock(&lock);
+            return i;
+        }
+    }
+
+    if (client_count == client_capacity) 
+    {
+        client_capacity = client_capacity ? 2 * client_capacity : 16;
+        client_names = realloc(client_names, client_capacity * sizeof(*client_names));
+        if (!client_names) 
+        {
+            perror("failed to allocate memory for clients");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int id = client_count++;
+    snprintf(client_names[id], sizeof(client_names[id]), "%s", name);
+    pthread_mutex_unlock(&lock);
+
+    return id;
+}
+
+void client_name(int client_id, char *name) 
+{
+    pthread_mutex_lock(&lock);
+    strcpy(name, client_names[client_id]);
+    pthread_mutex_unlock(&lock);
+}
+
+EventRing *register_event_ring() 
+{
+    EventRing *ring = (EventRing*) calloc(1, sizeof(EventRing));
+    if (!ring) 
+    {
+        perror("failed to allocate memory for event ring");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    ring->next = event_rings;
+    event_rings = ring;
+    pthread_mutex_unlock(&ring_lock);
+
+    thread_ring = ring;
+    return ring;
+}
+
+// records an event without locks or system calls beyond the clock read; when
+// the log thread falls a whole ring behind the event is counted and dropped
+void log_event(int type, int job_id, int peer, int part, double value) 
+{
+    EventRing *ring = thread_ring ? thread_ring : register_event_ring();
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == EVENT_RING_SIZE) 
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogEvent *event = &ring->events[head & (EVENT_RING_SIZE - 1)];
+    event->ns = monotonic_ns();
+    event->type = type;
+    event->part = part;
+    event->job_id = job_id;
+    event->peer = peer;
+    event->value = value;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int compare_events(const void *a, const void *b) 
+{
+    uint64_t x = ((const LogEvent*) a)->ns, y = ((const LogEvent*) b)->ns;
+    return (x > y) - (x < y);
+}
+
+void format_event(LogEvent *event) 
+{
+    double at = (event->ns - log_epoch_ns) / 1e9;
+    if (event->type == EVENT_UNKNOWN) 
+    {
+        fprintf(log_file, "[%.6f] Unknown command on line %d\n", at, event->job_id);
+        return;
+    }
+    if (event->type == EVENT_EXCLUDED) 
+    {
+        fprintf(log_file, "[%.6f] Worker %d excluded after timeouts on %d jobs in a row, its commands go to other workers\n", at, event->peer, WORKER_STRIKES);
+        return;
+    }
+
+    // the job table only grows, and the fields read here are fixed once the event exists
+    pthread_mutex_lock(&lock);
+    Job *job = &jobs[event->job_id];
+    char *description = job->description;
+    uint64_t received_ns = job->received_ns;
+    int parts = job->parts;
+    pthread_mutex_unlock(&lock);
+
+    switch (event->type) 
+    {
+    case EVENT_RECEIVED:
+        fprintf(log_file, "[%.6f] Command received: %s\n", at, description);
+        return;
+    case EVENT_CACHE_HIT:
+        fprintf(log_file, "[%.6f] Task answered from the result cache: %s\n", at, description);
+        return;
+    case EVENT_COALESCED:
+        fprintf(log_file, "[%.6f] Task waiting for the same task in flight: %s\n", at, description);
+        return;
+    case EVENT_COMPLETED:
+        fprintf(log_file, "[%.6f] Task completed by worker %d in %.3f ms: %s\n", at, event->peer, event->value, description);
+        return;
+    case EVENT_ANSWERED:
+        fprintf(log_file, "[%.6f] Task completed with the result of job %d: %s\n", at, event->peer, description);
+        return;
+    case EVENT_DISPATCHED:
+        fprintf(log_file, "[%.6f] Task dispatched to worker %d after %.3f ms in queue, estimated %.3f ms: %s", at, event->peer, (event->ns - received_ns) / 1e6, event->value, description);
+        break;
+    case EVENT_TIMED_OUT:
+        fprintf(log_file, "[%.6f] Task timed out on worker %d after %.3f ms: %s", at, event->peer, event->value, description);
+        break;
+    case EVENT_RETRIED:
+        fprintf(log_file, "[%.6f] Task queued again after attempt %d on worker %d: %s", at, (int)event->value, event->peer, description);
+        break;
+    case EVENT_FAILED:
+        fprintf(log_file, "[%.6f] Task given up after %d timeouts: %s", at, MAX_JOB_TIMEOUTS, description);
+        break;
+    case EVENT_CANCELLED:
+        fprintf(log_file, "[%.6f] Task cancelled on worker %d after %.3f ms, its result stalled or ran too long: %s", at, event->peer, event->value, description);
+        break;
+    }
+
+    // these concern one dispatch, which may be a part of a split job
+    if (parts > 1) 
+    {
+        fprintf(log_file, " (part %d of %d)", event->part + 1, parts);
+    }
+    fputc('\n', log_file);
+}
+
+// moves everything the rings hold into batch, growing it as needed; returns
+// the number of events taken
+int collect_events(LogEvent **batch, int *capacity) 
+{
+    int count = 0;
+
+    pthread_mutex_lock(&ring_lock);
+    for (EventRing *ring = event_rings; ring; ring = ring->next) 
+    {
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (count + (int)(head - tail) > *capacity) 
+        {
+            *capacity = 2 * (count + (int)(head - tail));
+            *batch = (LogEvent*) realloc(*batch, *capacity * sizeof(LogEvent));
+            if (!*batch) 
+            {
+                perror("failed to allocate memory for log events");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (; tail != head; tail++) 
+        {
+            (*batch)[count++] = ring->events[tail & (EVENT_RING_SIZE - 1)];
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    return count;
+}
+
+// the only thread that touches the log file; it wakes every LOG_DRAIN_MS and
+// writes what the other threads recorded, in timestamp order, flushing each
+// batch so the log of a long-running server can be followed as it grows
+void *log_thread(void *arg) 
+{
+    LogEvent *batch = NULL;
+    int capacity = 0;
+
+    while (1) 
+    {
+        int stopping = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+        int count = collect_events(&batch, &capacity);
+
+        qsort(batch, count, sizeof(LogEvent), compare_events);
+        if (binary_log) 
+        {
+            fwrite(batch, sizeof(LogEvent), count, log_file);
+        }
+        else 
+        {
+            for (int i = 0; i < count; i++) 
+            {
+                format_event(&batch[i]);
+            }
+        }
+        if (count > 0) 
+        {
+            fflush(log_file);
+        }
+
+        if (stopping) 
+        {
+            break;
+        }
+        if (count == 0) 
+        {
+            struct timespec pause = { 0, LOG_DRAIN_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+    fflush(log_file);
+
+    uint64_t dropped = 0;
+    while (event_rings) 
+    {
+        EventRing *ring = event_rings;
+        event_rings = ring->next;
+        dropped += ring->dropped;
+        free(ring);
+    }
+    if (dropped) 
+    {
+        fprintf(stderr, "%llu log events dropped, the log thread fell behind\n", (unsigned long long)dropped);
+    }
+
+    free(batch);
+    return NULL;
+}
+
+// queues a copy of text for the client file; only the receive thread queues,
+// so the writes of one result stay together and in order
+void queue_client_write(int client_id, const char *text, size_t length) 
+{
+    ClientWrite *write = (ClientWrite*) malloc(sizeof(ClientWrite) + length);
+    if (!write) 
+    {
+        perror("failed to allocate memory for client output");
+        exit(EXIT_FAILURE);
+    }
+    write->next = NULL;
+    write->client_id = client_id;
+    write->queued_ns = monotonic_ns();
+    write->length = length;
+    memcpy(write->data, text, length);
+
+    pthread_mutex_lock(&client_writes.lock);
+    while (client_writes.bytes > WRITE_QUEUE_LIMIT) 
+    {
+        pthread_cond_wait(&client_writes.space, &client_writes.lock);
+    }
+    if (client_writes.tail) 
+    {
+        client_writes.tail->next = write;
+    }
+    else 
+    {
+        // the first write of a batch starts its flush deadline and wakes the
+        // writer, which then waits for more until that deadline
+        client_writes.head = write;
+        clock_gettime(CLOCK_REALTIME, &client_writes.flush_by);
+        client_writes.flush_by.tv_nsec += WRITE_FLUSH_MS * 1000000L;
+        client_writes.flush_by.tv_sec += client_writes.flush_by.tv_nsec / 1000000000L;
+        client_writes.flush_by.tv_nsec %= 1000000000L;
+        pthread_cond_signal(&client_writes.ready);
+    }
+    client_writes.tail = write;
+    client_writes.bytes += length;
+    if (client_writes.bytes >= WRITE_BATCH_BYTES) 
+    {
+        pthread_cond_signal(&client_writes.ready);
+    }
+    pthread_mutex_unlock(&client_writes.lock);
+}
+
+void queue_client_line(int client_id) 
+{
+    char line[40];
+    client_name(client_id, line);
+    strcat(line, "\n");
+    queue_client_write(client_id, line, strlen(line));
+}
+
+// queues one result for its client file: the client line, then the text
+void write_client_result(int client_id, const char *text, size_t length) 
+{
+    queue_client_line(client_id);
+    queue_client_write(client_id, text, length);
+}
+
+// returns an open descriptor for the client file, closing the least recently
+// used one when CLIENT_FD_LIMIT files are already open
+int client_fd(int client_id) 
+{
+    static unsigned long clock;
+    clock++;
+
+    int victim = 0;
+    for (int i = 0; i < client_file_count; i++) 
+    {
+        if (client_files[i].client_id == client_id) 
+        {
+            client_files[i].last_used = clock;
+            return client_files[i].fd;
+        }
+        if (client_files[i].last_used < client_files[victim].last_used) 
+        {
+            victim = i;
+        }
+    }
+
+    char client[32], filename[64];
+    client_name(client_id, client);
+    snprintf(filename, sizeof(filename), "%s.txt", client);
+    int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) 
+    {
+        perror("failed to open client file");
+        return -1;
+    }
+
+    if (client_file_count < CLIENT_FD_LIMIT) 
+    {
+        victim = client_file_count++;
+    }
+    else 
+    {
+        close(client_files[victim].fd);
+    }
+    client_files[victim].client_id = client_id;
+    client_files[victim].fd = fd;
+    client_files[victim].last_used = clock;
+    return fd;
+}
+
+void write_all(int fd, struct iovec *iov, int count) 
+{
+    while (count > 0) 
+    {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) 
+        {
+            if (errno == EINTR) 
+            {
+                continue;
+            }
+            perror("failed to write client file");
+            return;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) 
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) 
+        {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// writes a batch of queued output, one writev per run of writes to the same client
+void write_batch(ClientWrite *write) 
+{
+    struct iovec iov[WRITE_IOV_MAX];
+    while (write) 
+    {
+        int client_id = write->client_id;
+        ClientWrite *run = write;
+        int count = 0;
+        while (write && write->client_id == client_id && count < WRITE_IOV_MAX) 
+        {
+            iov[count].iov_base = write->data;
+            iov[count].iov_len = write->length;
+            count++;
+            write = write->next;
+        }
+
+        int fd = client_fd(client_id);
+        if (fd >= 0) 
+        {
+            write_all(fd, iov, count);
+        }
+
+        uint64_t written_ns = monotonic_ns();
+        while (run != write) 
+        {
+            ClientWrite *next = run->next;
+            uint64_t wait_ns = written_ns - run->queued_ns;
+            client_writes.written++;
+            client_writes.wait_ns += wait_ns;
+            if (wait_ns > client_writes.max_wait_ns) 
+            {
+                client_writes.max_wait_ns = wait_ns;
+            }
+            free(run);
+            run = next;
+        }
+    }
+}
+
+// takes the client output off the receive thread: it sleeps until output is
+// queued, then lets it gather until WRITE_FLUSH_MS after the oldest queued
+// write before writing it all, so no result waits longer than that
+void *writer_thread(void *arg) 
+{
+    while (1) 
+    {
+        pthread_mutex_lock(&client_writes.lock);
+        while (!client_writes.head && !client_writes.stopping) 
+        {
+            pthread_cond_wait(&client_writes.ready, &client_writes.lock);
+        }
+
+        while (client_writes.head && client_writes.bytes < WRITE_BATCH_BYTES && !client_writes.stopping) 
+        {
+            if (pthread_cond_timedwait(&client_writes.ready, &client_writes.lock, &client_writes.flush_by) == ETIMEDOUT) 
+            {
+                break;
+            }
+        }
+
+        ClientWrite *batch = client_writes.head;
+        client_writes.head = client_writes.tail = NULL;
+        client_writes.bytes = 0;
+        int stopping = client_writes.stopping;
+        pthread_cond_broadcast(&client_writes.space);
+        pthread_mutex_unlock(&client_writes.lock);
+
+        write_batch(batch);
+        if (stopping && !batch) 
+        {
+            break;
+        }
+    }
+
+    for (int i = 0; i < client_file_count; i++) 
+    {
+        close(client_files[i].fd);
+    }
+    client_file_count = 0;
+    return NULL;
+}
+
+void text_append(TextBuffer *buffer, const char *text, size_t length) 
+{
+    if (buffer->overflow || buffer->length + length > buffer->limit) 
+    {
+        buffer->overflow = 1;
+        return;
+    }
+    if (buffer->length + length > buffer->capacity) 
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + length) 
+        {
+            capacity *= 2;
+        }
+        buffer->data = (char*) realloc(buffer->data, capacity);
+        if (!buffer->data) 
+        {
+            perror("failed to allocate memory for result text");
+            exit(EXIT_FAILURE);
+        }
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+}
+
+OutputQueue *output_queue(int client_id) 
+{
+    if (client_id >= output_queue_count) 
+    {
+        int count = output_queue_count ? 2 * output_queue_count : 16;
+        while (count <= client_id) 
+        {
+            count *= 2;
+        }
+        output_queues = (OutputQueue*) realloc(output_queues, count * sizeof(OutputQueue));
+        if (!output_queues) 
+        {
+            perror("failed to allocate memory for client output");
+            exit(EXIT_FAILURE);
+        }
+        memset(&output_queues[output_queue_count], 0, (count - output_queue_count) * sizeof(OutputQueue));
+        output_queue_count = count;
+    }
+    return &output_queues[client_id];
+}
+
+// the turn of a result has come: the client line and what it holds go out
+void start_output(ClientOutput *output) 
+{
+    output->direct = 1;
+    if (!output->dropped) 
+    {
+        queue_client_line(output->client_id);
+        if (output->held.length) 
+        {
+            queue_client_write(output->client_id, output->held.data, output->held.length);
+        }
+    }
+    free(output->held.data);
+    output->held = (TextBuffer) { .limit = SIZE_MAX };
+}
+
+// a result whose text is about to arrive; it goes straight to the writer if
+// the client has nothing else under way
+ClientOutput *open_output(int client_id) 
+{
+    ClientOutput *output = (ClientOutput*) calloc(1, sizeof(ClientOutput));
+    if (!output) 
+    {
+        perror("failed to allocate memory for client output");
+        exit(EXIT_FAILURE);
+    }
+    output->client_id = client_id;
+    output->held.limit = SIZE_MAX;
+
+    OutputQueue *queue = output_queue(client_id);
+    if (queue->tail) 
+    {
+        queue->tail->next = output;
+        queue->tail = output;
+        return output;
+    }
+    queue->head = queue->tail = output;
+    start_output(output);
+    return output;
+}
+
+void output_text(ClientOutput *output, const char *text, size_t length) 
+{
+    if (output->direct) 
+    {
+        queue_client_write(output->client_id, text, length);
+    }
+    else if (!output->dropped) 
+    {
+        text_append(&output->held, text, length);
+    }
+}
+
+// the result is complete; once it is the client's first, it and whatever
+// completed behind it leave, and the next one still arriving takes over
+void close_output(ClientOutput *output) 
+{
+    output->done = 1;
+    OutputQueue *queue = output_queue(output->client_id);
+    while (queue->head && queue->head->done) 
+    {
+        ClientOutput *done = queue->head;
+        queue->head = done->next;
+        if (!queue->head) 
+        {
+            queue->tail = NULL;
+        }
+        free(done->held.data);
+        free(done);
+        if (queue->head) 
+        {
+            start_output(queue->head);
+        }
+    }
+}
+
+// gives up a result: text already written stays, the rest is dropped
+void drop_output(ClientOutput *output) 
+{
+    output->dropped = 1;
+    free(output->held.data);
+    output->held = (TextBuffer) { .limit = SIZE_MAX };
+    close_output(output);
+}
+
+// a whole result, written now unless the client has a result under way
+void deliver_result(int client_id, const char *text, size_t length) 
+{
+    OutputQueue *queue = output_queue(client_id);
+    if (!queue->head) 
+    {
+        write_client_result(client_id, text, length);
+        return;
+    }
+    ClientOutput *output = open_output(client_id);
+    output_text(output, text, length);
+    close_output(output);
+}
+
+// the result cache and everything below is guarded by lock
+unsigned cache_hash(Command *command) 
+{
+    uint64_t hash = (uint64_t)command->opcode * 0x9E3779B97F4A7C15ULL ^ (uint64_t)command->arg;
+    for (char *c = command->word; *c; c++) 
+    {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001B3ULL;
+    }
+    hash ^= hash >> 29;
+    return hash % RESULT_CACHE_BUCKETS;
+}
+
+CacheEntry *cache_find(Command *command) 
+{
+    for (CacheEntry *entry = result_cache.buckets[cache_hash(command)]; entry; entry = entry->next) 
+    {
+        if (entry->opcode == command->opcode && entry->arg == command->arg && strcmp(entry->word, command->word) == 0) 
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void cache_unlink_lru(CacheEntry *entry) 
+{
+    if (entry->newer) 
+    {
+        entry->newer->older = entry->older;
+    }
+    else 
+    {
+        result_cache.newest = entry->older;
+    }
+    if (entry->older) 
+    {
+        entry->older->newer = entry->newer;
+    }
+    else 
+    {
+        result_cache.oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+void cache_link_newest(CacheEntry *entry) 
+{
+    entry->older = result_cache.newest;
+    entry->newer = NULL;
+    if (result_cache.newest) 
+    {
+        result_cache.newest->newer = entry;
+    }
+    else 
+    {
+        result_cache.oldest = entry;
+    }
+    result_cache.newest = entry;
+}
+
+size_t cache_entry_bytes(CacheEntry *entry) 
+{
+    return sizeof(CacheEntry) + entry->length;
+}
+
+// drops least recently used settled entries until the cache fits its budget
+void cache_evict() 
+{
+    CacheEntry *entry = result_cache.oldest;
+    while (result_cache.bytes > result_cache.budget && entry) 
+    {
+        CacheEntry *newer = entry->newer;
+        if (entry->pins == 0) 
+        {
+            cache_unlink_lru(entry);
+            CacheEntry **link = &result_cache.buckets[entry->bucket];
+            while (*link != entry) 
+            {
+                link = &(*link)->next;
+            }
+            *link = entry->next;
+
+            result_cache.bytes -= cache_entry_bytes(entry);
+            result_cache.entries--;
+            free(entry->text);
+            free(entry);
+        }
+        entry = newer;
+    }
+}
+
+// decides what to do with a job about to be dispatched: answer it from the
+// cache, attach it to an identical job in flight, or compute it
+int admit_job(int job_id) 
+{
+    Job *job = &jobs[job_id];
+    if (result_cache.budget == 0) 
+    {
+        return ADMIT_DISPATCH;
+    }
+
+    CacheEntry *entry = cache_find(&job->command);
+    if (!entry) 
+    {
+        entry = (CacheEntry*) calloc(1, sizeof(CacheEntry));
+        if (!entry) 
+        {
+            perror("failed to allocate memory for cache entry");
+            exit(EXIT_FAILURE);
+        }
+        entry->opcode = job->command.opcode;
+        entry->arg = job->command.arg;
+        strcpy(entry->word, job->command.word);
+        entry->state = CACHE_PENDING;
+        entry->waiters = -1;
+
+        entry->bucket = cache_hash(&job->command);
+        entry->next = result_cache.buckets[entry->bucket];
+        result_cache.buckets[entry->bucket] = entry;
+        result_cache.bytes += cache_entry_bytes(entry);
+        result_cache.entries++;
+
+        result_cache.misses++;
+        job->cache_entry = entry;
+        return ADMIT_DISPATCH;
+    }
+
+    if (entry->state == CACHE_READY) 
+    {
+        cache_unlink_lru(entry);
+        cache_link_newest(entry);
+        entry->pins++;
+        result_cache.hits++;
+        job->cache_entry = entry;
+        return ADMIT_HIT;
+    }
+    if (entry->state == CACHE_PENDING) 
+    {
+        int *link = &entry->waiters;
+        while (*link >= 0) 
+        {
+            link = &jobs[*link].next_waiter;
+        }
+        *link = job_id;
+        __atomic_add_fetch(&coalesced_count, 1, __ATOMIC_RELAXED);
+        result_cache.coalesced++;
+        return ADMIT_COALESCED;
+    }
+
+    cache_unlink_lru(entry);
+    cache_link_newest(entry);
+    result_cache.misses++;
+    return ADMIT_DISPATCH;
+}
+
+// settles the entry a finished job computed and returns the jobs that waited
+// for it; when the result is too large to keep they are queued again instead
+// and -1 is returned
+int settle_job(Job *job, const char *text, size_t length, int overflow) 
+{
+    pthread_mutex_lock(&lock);
+    CacheEntry *entry = job->cache_entry;
+    int waiters = entry->waiters;
+    entry->waiters = -1;
+
+    if (!overflow && length <= result_cache.budget / 16) 
+    {
+        entry->text = (char*) malloc(length);
+        if (!entry->text) 
+        {
+            perror("failed to allocate memory for cached result");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(entry->text, text, length);
+        entry->length = length;
+        entry->state = CACHE_READY;
+        result_cache.bytes += length;
+    }
+    else 
+    {
+        entry->state = CACHE_TOO_LARGE;
+        pthread_mutex_lock(&schedule_lock);
+        for (int w = waiters; w >= 0; w = jobs[w].next_waiter) 
+        {
+            schedule_job(&jobs[w]);
+            __atomic_sub_fetch(&coalesced_count, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&schedule_lock);
+        waiters = -1;
+    }
+    cache_link_newest(entry);
+    cache_evict();
+
+    for (int w = waiters; w >= 0; w = jobs[w].next_waiter) 
+    {
+        __atomic_sub_fetch(&coalesced_count, 1, __ATOMIC_RELAXED);
+    }
+    wake_scheduler();
+    pthread_mutex_unlock(&lock);
+
+    return waiters;
+}
+
+// writes a finished result for every job that waited on it
+void answer_waiters(int leader, int waiters, const char *text, size_t length) 
+{
+    while (waiters >= 0) 
+    {
+        pthread_mutex_lock(&lock);
+        jobs[waiters].completed_ns = monotonic_ns();
+        Job waiter = jobs[waiters];
+        pthread_mutex_unlock(&lock);
+
+        deliver_result(waiter.command.client_id, text, length);
+        log_event(EVENT_ANSWERED, waiters, leader, 0, 0);
+
+        waiters = waiter.next_waiter;
+    }
+}
+
+// records a dispatch about to be sent and stamps its ticket and deadline;
+// fails when the worker was excluded after its credit was taken, the credit
+// then being gone. Called with lock held
+int track_dispatch(int worker_id, Dispatch *dispatch) 
+{
+    if (worker_health[worker_id].excluded) 
+    {
+        return 0;
+    }
+
+    int slot = free_slots[--free_slot_count];
+    Dispatch *tracked = &dispatches[slot];
+    dispatch->ticket = tracked->ticket + dispatch_capacity;
+    dispatch->command.ticket = dispatch->ticket;
+    dispatch->live = 1;
+    dispatch->answering = 0;
+    dispatch->worker_id = worker_id;
+    dispatch->attempts++;
+    dispatch->dispatched_ns = monotonic_ns();
+    double allowed_ms = fmax(deadline_min_ms, DEADLINE_FACTOR * dispatch->estimate_ms);
+    dispatch->deadline_ns = dispatch->dispatched_ns + (uint64_t)(allowed_ms * 1e6);
+    *tracked = *dispatch;
+    __atomic_add_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+// frees the slot of a dispatch; called with lock held
+void retire_dispatch(Dispatch *dispatch) 
+{
+    dispatch->live = 0;
+    free_slots[free_slot_count++] = dispatch - dispatches;
+}
+
+// gives up a dispatch and queues its command for another worker; called with
+// lock held
+void queue_retry(Dispatch *dispatch) 
+{
+    retire_dispatch(dispatch);
+    retried_count++;
+    log_event(EVENT_RETRIED, dispatch->command.job_id, dispatch->worker_id, dispatch->part, dispatch->attempts);
+
+    pthread_mutex_lock(&schedule_lock);
+    retries[(retry_head + retry_count) % dispatch_capacity] = *dispatch;
+    retry_count++;
+    __atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&job_queued);
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+// takes a worker out of service: its free credits leave the ring, the ones
+// its commands hold are dropped as they come back, and those commands go to
+// the other workers; called with lock held
+void exclude_worker(int worker_id) 
+{
+    WorkerHealth *health = &worker_health[worker_id];
+    live_workers--;
+    pthread_mutex_lock(&credit_lock);
+    health->excluded = 1;
+    live_credits -= worker_capacity[worker_id] * prefetch_depth - health->written_off;
+    health->written_off = 0;
+
+    int kept = 0;
+    for (int i = 0; i < free_count; i++) 
+    {
+        int id = free_workers[(free_head + i) % free_capacity];
+        if (id != worker_id) 
+        {
+            free_workers[(free_head + kept++) % free_capacity] = id;
+        }
+    }
+    free_count = kept;
+    pthread_cond_broadcast(&worker_freed);
+    pthread_mutex_unlock(&credit_lock);
+    log_event(EVENT_EXCLUDED, -1, worker_id, 0, 0);
+
+    for (int slot = 0; slot < dispatch_capacity; slot++) 
+    {
+        Dispatch *dispatch = &dispatches[slot];
+        if (dispatch->live && !dispatch->answering && dispatch->worker_id == worker_id) 
+        {
+            queue_retry(dispatch);
+        }
+    }
+}
+
+// gives up the dispatches past their deadline that have not started to
+// answer: each goes to the retry queue, or fails once it has timed out
+// MAX_JOB_TIMEOUTS times, and its credit is written off until a late result
+// brings it back. A worker timing out on WORKER_STRIKES different jobs
+// without a result in between is excluded, unless it is the last one; a
+// single bad job only costs the workers it visits a thread each. A dispatch
+// whose answer stalls for deadline_min_ms or is still arriving at its
+// deadline is cancelled, and its job fails
+void *watchdog_thread(void *arg) 
+{
+    Dispatch *failed = (Dispatch*) malloc(dispatch_capacity * sizeof(Dispatch));
+    if (!failed) 
+    {
+        perror("failed to allocate memory for the watchdog");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&lock);
+    while (1) 
+    {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += WATCHDOG_MS * 1000000L;
+        wake.tv_sec += wake.tv_nsec / 1000000000L;
+        wake.tv_nsec %= 1000000000L;
+        while (!watchdog_stopping && pthread_cond_timedwait(&watchdog_wake, &lock, &wake) != ETIMEDOUT) 
+        {
+        }
+        if (watchdog_stopping) 
+        {
+            break;
+        }
+
+        int failed_now = 0;
+        uint64_t now = monotonic_ns();
+        for (int slot = 0; slot < dispatch_capacity; slot++) 
+        {
+            Dispatch *dispatch = &dispatches[slot];
+            uint64_t due = dispatch->deadline_ns;
+            if (dispatch->answering && dispatch->progress_ns < due) 
+            {
+                due = dispatch->progress_ns;
+            }
+            if (!dispatch->live || now < due) 
+            {
+                continue;
+            }
+
+            int worker_id = dispatch->worker_id;
+            WorkerHealth *health = &worker_health[worker_id];
+            if (dispatch->answering) 
+            {
+                // the worker is told to stop before the credit is written
+                // off, so the STOP sent once the other credits are back
+                // comes after it
+                Command cancel = { .opcode = OP_CANCEL, .ticket = dispatch->ticket };
+                MPI_Send(&cancel, offsetof(Command, word), MPI_BYTE, worker_id, TAG_COMMAND, MPI_COMM_WORLD);
+                retire_dispatch(dispatch);
+                failed[failed_now++] = *dispatch;
+                cancelled_count++;
+                jobs[dispatch->command.job_id].failed = FAILED_CANCELLED;
+                log_event(EVENT_CANCELLED, dispatch->command.job_id, worker_id, dispatch->part, (now - dispatch->dispatched_ns) / 1e6);
+                write_off_credit(worker_id);
+                continue;
+            }
+
+            timed_out_count++;
+            dispatch->timeouts++;
+            log_event(EVENT_TIMED_OUT, dispatch->command.job_id, worker_id, dispatch->part, (now - dispatch->dispatched_ns) / 1e6);
+            if (dispatch->timeouts < MAX_JOB_TIMEOUTS) 
+            {
+                queue_retry(dispatch);
+            }
+            else 
+            {
+                // still in flight until the receiver has answered the job
+                retire_dispatch(dispatch);
+                failed[failed_now++] = *dispatch;
+                failed_count++;
+                jobs[dispatch->command.job_id].failed = FAILED_TIMEOUTS;
+                log_event(EVENT_FAILED, dispatch->command.job_id, worker_id, dispatch->part, 0);
+            }
+
+            write_off_credit(worker_id);
+            if (health->strikes == 0 || health->struck_job != dispatch->command.job_id) 
+            {
+                health->strikes++;
+                health->struck_job = dispatch->command.job_id;
+            }
+            if (health->strikes >= WORKER_STRIKES && live_workers > 1) 
+            {
+                exclude_worker(worker_id);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+
+        // client files are written by the receiver alone, so hand it the failures
+        for (int f = 0; f < failed_now; f++) 
+        {
+            ResultMessage failure = { .client_id = failed[f].command.client_id, .job_id = failed[f].command.job_id, .ticket = failed[f].ticket };
+            MPI_Send(&failure, offsetof(ResultMessage, text), MPI_BYTE, 0, TAG_FAILED, MPI_COMM_WORLD);
+        }
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    free(failed);
+    return NULL;
+}
+
+// a chunk of a streamed result: the first marks its dispatch as answering,
+// and each one gives the next deadline_min_ms to arrive; returns 0 if the
+// dispatch was given up, the rest of the stream then being dropped
+int progress_dispatch(uint32_t ticket) 
+{
+    pthread_mutex_lock(&lock);
+    Dispatch *dispatch = &dispatches[ticket % dispatch_capacity];
+    int live = dispatch->live && dispatch->ticket == ticket;
+    if (live) 
+    {
+        dispatch->answering = 1;
+        dispatch->progress_ns = monotonic_ns() + deadline_min_ms * 1000000ULL;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return live;
+}
+
+// the last message of a result: retires its dispatch and hands the credit
+// back; a late result of a dispatch given up returns the credit written off
+// for it, unless its worker was excluded since. Returns 0 in that case, the
+// result then being dropped
+int finish_dispatch(uint32_t ticket, int worker_id) 
+{
+    pthread_mutex_lock(&lock);
+    WorkerHealth *health = &worker_health[worker_id];
+    Dispatch *dispatch = &dispatches[ticket % dispatch_capacity];
+    int live = dispatch->live && dispatch->ticket == ticket;
+    if (live) 
+    {
+        retire_dispatch(dispatch);
+        __atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+        health->strikes = 0;
+        wake_scheduler();
+    }
+    pthread_mutex_lock(&credit_lock);
+    if (!live && !health->excluded) 
+    {
+        health->written_off--;
+        live_credits++;
+    }
+    return_credit(worker_id);
+    pthread_mutex_unlock(&credit_lock);
+    pthread_mutex_unlock(&lock);
+
+    return live;
+}
+
+// a failed job leaves its entry uncached, so a later copy is tried afresh;
+// the jobs that waited for it share the failure and are returned
+int abandon_entry(Job *job) 
+{
+    pthread_mutex_lock(&lock);
+    CacheEntry *entry = job->cache_entry;
+    int waiters = entry->waiters;
+    entry->waiters = -1;
+    entry->state = CACHE_TOO_LARGE;
+    cache_link_newest(entry);
+    cache_evict();
+
+    for (int w = waiters; w >= 0; w = jobs[w].next_waiter) 
+    {
+        __atomic_sub_fetch(&coalesced_count, 1, __ATOMIC_RELAXED);
+    }
+    wake_scheduler();
+    pthread_mutex_unlock(&lock);
+
+    return waiters;
+}
+
+// waits up to deadline_ns for any message; 1 once one is there
+int probe_until(uint64_t deadline_ns) 
+{
+    struct timespec pause = { 0, 1000000 };
+    while (1) 
+    {
+        int flag;
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+        if (flag) 
+        {
+            return 1;
+        }
+        if (monotonic_ns() >= deadline_ns) 
+        {
+            return 0;
+        }
+        nanosleep(&pause, NULL);
+    }
+}
+
+// whether every worker that never missed a deadline has stopped; the others
+// may have a thread that will never come back
+int healthy_workers_stopped() 
+{
+    pthread_mutex_lock(&lock);
+    int stopped = 1;
+    for (int w = 1; w <= num_workers; w++) 
+    {
+        WorkerHealth *health = &worker_health[w];
+        if (!health->excluded && !health->written_off && !health->stopped) 
+        {
+            stopped = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return stopped;
+}
+
+// probes first so every message is received at its exact size; returns that size
+int receive_result(ResultMessage *result, int source, int tag, MPI_Status *status) 
+{
+    int length;
+    MPI_Probe(source, tag, MPI_COMM_WORLD, status);
+    MPI_Get_count(status, MPI_BYTE, &length);
+    if (length < (int)offsetof(ResultMessage, text) || length > (int)sizeof(ResultMessage)) 
+    {
+        fprintf(stderr, "malformed result of %d bytes from worker %d\n", length, status->MPI_SOURCE);
+        exit(EXIT_FAILURE);
+    }
+
+    MPI_Recv(result, length, MPI_BYTE, status->MPI_SOURCE, status->MPI_TAG, MPI_COMM_WORLD, status);
+    if (length == (int)offsetof(ResultMessage, text)) 
+    {
+        result->text[0] = '\0';
+    }
+    return length;
+}
+
+// a stream whose dispatch was given up: what it wrote stays, the rest is dropped
+void give_up_stream(ResultStream *stream) 
+{
+    stream->live = 0;
+    if (stream->output) 
+    {
+        drop_output(stream->output);
+        stream->output = NULL;
+    }
+}
+
+// routes a chunk to the stream of its dispatch, opening the stream on the
+// first; returns the stream once its end has arrived, or NULL while more is to
+// come and for a stream given up, which is drained and dropped
+ResultStream *receive_chunk(ResultStream **streams, int worker_id, ResultMessage *result) 
+{
+    ResultStream **link = streams;
+    while (*link && (*link)->ticket != result->ticket) 
+    {
+        link = &(*link)->next;
+    }
+    ResultStream *stream = *link;
+    if (!stream) 
+    {
+        stream = (ResultStream*) calloc(1, sizeof(ResultStream));
+        if (!stream) 
+        {
+            perror("failed to allocate memory for result stream");
+            exit(EXIT_FAILURE);
+        }
+        stream->ticket = result->ticket;
+        stream->capture.limit = result_cache.budget / 16;
+        stream->live = 1;
+        stream->next = *streams;
+        *streams = stream;
+        link = streams;
+    }
+
+    if (result->shared_length || result->text[0]) 
+    {
+        SharedRing *ring = result->shared_length ? &shared_rings[worker_id][result->shared_ring] : NULL;
+        char *text = ring ? ring->slots[result->value % SHARED_RING_SLOTS] : result->text;
+        size_t text_length = ring ? (size_t)result->shared_length : strlen(text);
+        if (ring) 
+        {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }
+        if (stream->live && !progress_dispatch(result->ticket)) 
+        {
+            give_up_stream(stream);
+        }
+        if (stream->live) 
+        {
+            if (!stream->output) 
+            {
+                stream->output = open_output(result->client_id);
+            }
+            output_text(stream->output, text, text_length);
+            text_append(&stream->capture, text, text_length);
+        }
+        if (ring) 
+        {
+            __atomic_store_n(&ring->tail, result->value + 1, __ATOMIC_RELEASE);
+        }
+        return NULL;
+    }
+
+    *link = stream->next;
+    if (finish_dispatch(result->ticket, worker_id) && stream->live) 
+    {
+        close_output(stream->output);
+        return stream;
+    }
+    give_up_stream(stream);
+    free(stream->capture.data);
+    free(stream);
+    return NULL;
+}
+
+// records one finished part of a job; once all parts are in, the measured
+// service time refines the cost model of the job's opcode. The error is
+// shared between the two terms by how much of the estimate each makes up, so
+// a tiny job moves the overhead and leaves the per-unit cost of large jobs
+// alone, and a large one does the reverse
+Job complete_job_part(ResultMessage *result) 
+{
+    pthread_mutex_lock(&lock);
+    Job *job = &jobs[result->job_id];
+    job->count += result->value;
+    job->service_ms += result->service_ms;
+    job->parts_done++;
+    if (job->parts_done == job->parts) 
+    {
+        job->completed_ns = monotonic_ns();
+    }
+    if (job->parts_done == job->parts && job->work > 0 && !job->failed) 
+    {
+        int opcode = job->command.opcode;
+        double measured = job->service_ms / 1e3;
+        double coefficient, overhead;
+        __atomic_load(&cost_per_unit[opcode], &coefficient, __ATOMIC_RELAXED);
+        __atomic_load(&cost_overhead[opcode], &overhead, __ATOMIC_RELAXED);
+        double scaled = coefficient * job->work;
+        double share = scaled / (overhead + scaled);
+        coefficient += COST_LEARNING_RATE * share * (fmax(measured - overhead, 0) / job->work - coefficient);
+        overhead += COST_LEARNING_RATE * (1 - share) * (fmax(measured - scaled, 0) - overhead);
+        __atomic_store(&cost_per_unit[opcode], &coefficient, __ATOMIC_RELAXED);
+        __atomic_store(&cost_overhead[opcode], &overhead, __ATOMIC_RELAXED);
+    }
+    Job snapshot = *job;
+    pthread_mutex_unlock(&lock);
+
+    return snapshot;
+}
+
+// writes a job answered from the cache; the entry is pinned until then
+void answer_from_cache(int job_id) 
+{
+    pthread_mutex_lock(&lock);
+    Job job = jobs[job_id];
+    pthread_mutex_unlock(&lock);
+
+    deliver_result(job.command.client_id, job.cache_entry->text, job.cache_entry->length);
+
+    pthread_mutex_lock(&lock);
+    job.cache_entry->pins--;
+    jobs[job_id].completed_ns = monotonic_ns();
+    pthread_mutex_unlock(&lock);
+}
+
+void *receive_thread(void *arg) 
+{
+    ResultMessage *result = (ResultMessage*) malloc(sizeof(ResultMessage));
+    if (!result) 
+    {
+        perror("error allocating memory for result");
+        exit(EXIT_FAILURE);
+    }
+    ResultStream *streams = NULL;   // open streams, newest first
+
+    int stopped = 0;
+    uint64_t grace_ns = 0;
+    while (stopped < num_workers)
+    {
+        // a worker excluded or still holding a command that timed out may be
+        // hung for good: once all the others have stopped, it gets
+        // deadline_min_ms to do the same
+        if (!grace_ns && healthy_workers_stopped()) 
+        {
+            grace_ns = monotonic_ns() + deadline_min_ms * 1000000ULL;
+        }
+        if (grace_ns && !probe_until(grace_ns)) 
+        {
+            abandoned_workers = num_workers - stopped;
+            break;
+        }
+
+        MPI_Status status;
+        receive_result(result, MPI_ANY_SOURCE, MPI_ANY_TAG, &status);
+
+        int worker_id = status.MPI_SOURCE;
+        int streamed = (status.MPI_TAG == TAG_CHUNK);
+        ResultStream *stream = NULL;
+
+        if (status.MPI_TAG == TAG_STOP) 
+        {
+            printf("Received STOP from worker %d.\n", worker_id);
+            pthread_mutex_lock(&lock);
+            worker_health[worker_id].stopped = 1;
+            pthread_mutex_unlock(&lock);
+            stopped++;
+            continue;
+        }
+        if (status.MPI_TAG == TAG_CACHED) 
+        {
+            answer_from_cache(result->job_id);
+            continue;
+        }
+        if (status.MPI_TAG == TAG_FAILED) 
+        {
+            // a cancelled stream may still be arriving
+            for (ResultStream *open = streams; open; open = open->next) 
+            {
+                if (open->ticket == result->ticket && open->live) 
+                {
+                    give_up_stream(open);
+                }
+            }
+            __atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELAXED);
+            wake_scheduler();
+        }
+        else if (streamed) 
+        {
+            stream = receive_chunk(&streams, worker_id, result);
+            if (!stream) 
+            {
+                continue;
+            }
+
+            log_event(EVENT_COMPLETED, result->job_id, worker_id, 0, result->service_ms);
+            worker_busy_ms[worker_id] += result->service_ms;
+        }
+        else 
+        {
+            if (!finish_dispatch(result->ticket, worker_id)) 
+            {
+                continue;
+            }
+
+            log_event(EVENT_COMPLETED, result->job_id, worker_id, 0, result->service_ms);
+            worker_busy_ms[worker_id] += result->service_ms;
+        }
+
+        Job job = complete_job_part(result);
+        if (job.parts_done < job.parts) 
+        {
+            continue;
+        }
+
+        if (job.failed) 
+        {
+            int length = job.failed == FAILED_CANCELLED ?
+                snprintf(result->text, sizeof(result->text), "Task cancelled, its result stalled or ran past its deadline: %s\n", job.description) :
+                snprintf(result->text, sizeof(result->text), "Task failed after %d timeouts: %s\n", MAX_JOB_TIMEOUTS, job.description);
+            deliver_result(job.command.client_id, result->text, length);
+            if (job.cache_entry) 
+            {
+                answer_waiters(job.command.job_id, abandon_entry(&job), result->text, length);
+            }
+            continue;
+        }
+
+        char *text = stream ? stream->capture.data : NULL;
+        size_t length = stream ? stream->capture.length : 0;
+        if (!streamed) 
+        {
+            if (status.MPI_TAG == TAG_PART) 
+            {
+                snprintf(result->text, sizeof(result->text), "Found %lld primes in the first %lld numbers.", job.count, (long long)job.command.arg);
+            }
+            text = result->text;
+            length = strlen(text);
+            text[length++] = '\n';
+            deliver_result(job.command.client_id, text, length);
+        }
+
+        if (job.cache_entry) 
+        {
+            int waiters = settle_job(&job, text, length, streamed && stream->capture.overflow);
+            answer_waiters(job.command.job_id, waiters, text, length);
+        }
+        if (stream) 
+        {
+            free(stream->capture.data);
+            free(stream);
+        }
+    }
+    printf("Terminating receiver thread.\n");
+
+    // streams of workers given up for hung never end
+    while (streams) 
+    {
+        ResultStream *stream = streams;
+        streams = stream->next;
+        if (stream->live) 
+        {
+            drop_output(stream->output);
+        }
+        free(stream->capture.data);
+        free(stream);
+    }
+    for (int c = 0; c < output_queue_count; c++) 
+    {
+        while (output_queues[c].head) 
+        {
+            ClientOutput *output = output_queues[c].head;
+            output_queues[c].head = output->next;
+            free(output->held.data);
+            free(output);
+        }
+    }
+    free(output_queues);
+    free(result);
+    return NULL;
+}
+
+void execute_command(Command *command, ResultMessage *result) 
+{
+    result->client_id = command->client_id;
+    result->job_id = command->job_id;
+    result->ticket = command->ticket;
+    result->value = 0;
+    result->service_ms = 0;
+    result->shared_length = 0;
+    result->shared_ring = 0;
+    result->text[0] = '\0';
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if (command->opcode == OP_PRIMES_RANGE) 
+    {
+        result->value = count_primes_range(command->arg, command->arg2);
+        result->service_ms = elapsed_ms(&started);
+        MPI_Send(result, offsetof(ResultMessage, text), MPI_BYTE, 0, TAG_PART, MPI_COMM_WORLD);
+        return;
+    }
+    else if (command->opcode == OP_PRIMES) 
+    {
+        long long count = count_primes(command->arg);
+        snprintf(result->text, sizeof(result->text), "Found %lld primes in the first %lld numbers.", count, (long long)command->arg);
+    } 
+    else if (command->opcode == OP_PRIMEDIVISORS) 
+    {
+        int count = count_prime_divisors((uint64_t)command->arg);
+        snprintf(result->text, sizeof(result->text), "Found %d prime divisors of %llu.", count, (unsigned long long)command->arg);
+    } 
+    else if (command->opcode == OP_ANAGRAMS && anagram_bytes(command->word) > ANAGRAM_OUTPUT_LIMIT) 
+    {
+        snprintf(result->text, sizeof(result->text), "Too many anagrams of %s to list, the limit is %lld MB.", command->word, ANAGRAM_OUTPUT_LIMIT >> 20);
+    }
+    else if (command->opcode == OP_ANAGRAMS) 
+    {
+        stream_anagrams(command->word, result, &started);
+        return;
+    }
+    else 
+    {
+        snprintf(result->text, sizeof(result->text), "Unknown task: %d", command->opcode);
+    }
+    result->service_ms = elapsed_ms(&started);
+
+    MPI_Send(result, result_length(result), MPI_BYTE, 0, TAG_RESULT, MPI_COMM_WORLD);
+}
+
+void *worker_thread(void *arg) 
+{
+    WorkQueue *queue = (WorkQueue*) arg;
+    ResultMessage *result = (ResultMessage*) malloc(sizeof(ResultMessage));
+    if (!result) 
+    {
+        perror("failed to allocate memory in worker thread");
+        exit(EXIT_FAILURE);
+    }
+    if (worker_rings) 
+    {
+        shared_ring = &worker_rings[__atomic_fetch_add(&queue->started, 1, __ATOMIC_RELAXED)];
+    }
+
+    while (1) 
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && !queue->stopping) 
+        {
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        if (queue->count == 0) 
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        Command command = queue->commands[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_mutex_unlock(&queue->lock);
+
+        execute_command(&command, result);
+    }
+
+    free(result);
+    return NULL;
+}
+
+// the main server never has more than threads * prefetch_depth commands
+// outstanding on a worker (its credits), so one posted receive per credit
+// means the next job is already local when a thread finishes; the main thread
+// only moves commands from the wire to the pool
+void worker_process(int rank) 
+{
+    int credits = worker_threads * prefetch_depth;
+    WorkQueue queue = { .capacity = credits, .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+    queue.commands = (Command*) malloc(credits * sizeof(Command));
+    Command *posted = (Command*) malloc(credits * sizeof(Command));
+    MPI_Request *requests = (MPI_Request*) malloc(credits * sizeof(MPI_Request));
+    pthread_t *threads = (pthread_t*) malloc(worker_threads * sizeof(pthread_t));
+    if (!queue.commands || !posted || !requests || !threads) 
+    {
+        perror("failed to allocate memory in worker");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int k = 0; k < credits; k++) 
+    {
+        MPI_Irecv(&posted[k], sizeof(Command), MPI_BYTE, 0, TAG_COMMAND, MPI_COMM_WORLD, &requests[k]);
+    }
+    for (int t = 0; t < worker_threads; t++) 
+    {
+        pthread_create(&threads[t], NULL, worker_thread, &queue);
+    }
+
+    // commands from one sender match the posted receives in order
+    int next = 0;
+    while (1) 
+    {
+        MPI_Wait(&requests[next], MPI_STATUS_IGNORE);
+        Command command = posted[next];
+        if (command.opcode == OP_STOP) 
+        {
+            for (int k = 0; k < credits; k++) 
+            {
+                if (k != next) 
+                {
+                    MPI_Cancel(&requests[k]);
+                    MPI_Wait(&requests[k], MPI_STATUS_IGNORE);
+                }
+            }
+            break;
+        }
+        MPI_Irecv(&posted[next], sizeof(Command), MPI_BYTE, 0, TAG_COMMAND, MPI_COMM_WORLD, &requests[next]);
+        next = (next + 1) % credits;
+        if (command.opcode == OP_CANCEL) 
+        {
+            __atomic_store_n(&cancelled_tickets[cancelled_next++ % CANCELLED_TICKETS], command.ticket, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // never full: the main server sends at most one command per credit
+        pthread_mutex_lock(&queue.lock);
+        queue.commands[(queue.head + queue.count) % queue.capacity] = command;
+        queue.count++;
+        pthread_cond_signal(&queue.ready);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    queue.stopping = 1;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+    for (int t = 0; t < worker_threads; t++) 
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    ResultMessage stop = {0};
+    MPI_Send(&stop, offsetof(ResultMessage, text), MPI_BYTE, 0, TAG_STOP, MPI_COMM_WORLD);
+
+    free(queue.commands);
+    free(posted);
+    free(requests);
+    free(threads);
+}
+
+// the bytes of command that go on the wire
+int command_length(Command *command) 
+{
+    if (command->opcode == OP_ANAGRAMS) 
+    {
+        return offsetof(Command, word) + strlen(command->word) + 1;
+    }
+    return offsetof(Command, word);
+}
+
+// turns "CLIENT TASK ARG" into a binary command; returns 0 for unknown tasks
+int encode_command(char *line, Command *command) 
+{
+    char client[32] = {0}, task[32] = {0}, param[32] = {0};
+    sscanf(line, "%31s %31s %31s", client, task, param);
+
+    memset(command, 0, sizeof(Command));
+    if (strcmp(task, "PRIMES") == 0) 
+    {
+        command->opcode = OP_PRIMES;
+        command->arg = atoll(param);
+    }
+    else if (strcmp(task, "PRIMEDIVISORS") == 0) 
+    {
+        command->opcode = OP_PRIMEDIVISORS;
+        command->arg = (int64_t)parse_u64(param);
+    }
+    else if (strcmp(task, "ANAGRAMS") == 0) 
+    {
+        command->opcode = OP_ANAGRAMS;
+        snprintf(command->word, sizeof(command->word), "%s", param);
+    }
+    else 
+    {
+        return 0;
+    }
+    command->client_id = client_id_for(client);
+
+    return 1;
+}
+
+// the size of a job in the units of the cost model: n log log n for the sieve,
+// the trial divisions plus the Pollard-Rho steps for factoring, and the
+// distinct permutations times their length for anagrams
+double job_work(Command *command) 
+{
+    if (command->opcode == OP_PRIMES) 
+    {
+        double n = command->arg > 16 ? (double)command->arg : 16;
+        return n * log(log(n));
+    }
+    if (command->opcode == OP_PRIMEDIVISORS) 
+    {
+        return 6542 + sqrt(sqrt((double)(uint64_t)command->arg));
+    }
+    if (command->opcode == OP_ANAGRAMS) 
+    {
+        // a refused word costs next to nothing
+        double bytes = anagram_bytes(command->word);
+        return bytes > ANAGRAM_OUTPUT_LIMIT ? 0 : bytes;
+    }
+    return 0;
+}
+
+double estimate_ms(int opcode, double work) 
+{
+    double coefficient, overhead;
+    __atomic_load(&cost_per_unit[opcode], &coefficient, __ATOMIC_RELAXED);
+    __atomic_load(&cost_overhead[opcode], &overhead, __ATOMIC_RELAXED);
+    return (overhead + coefficient * work) * 1e3;
+}
+
+double job_estimate_ms(Job *job) 
+{
+    return estimate_ms(job->command.opcode, job->work);
+}
+
+// appends a job to the table; called with lock held
+int add_job(Command *command, char *description, uint64_t received_ns) 
+{
+    if (job_count == job_capacity) 
+    {
+        job_capacity = job_capacity ? 2 * job_capacity : 64;
+        jobs = (Job*) realloc(jobs, job_capacity * sizeof(Job));
+        if (!jobs) 
+        {
+            perror("failed to allocate memory for jobs");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int job_id = job_count++;
+    Job *job = &jobs[job_id];
+    memset(job, 0, sizeof(Job));
+    job->command = *command;
+    job->command.job_id = job_id;
+    snprintf(job->description, sizeof(job->description), "%.*s", (int)strcspn(description, "\n"), description);
+    job->received_ns = received_ns;
+    job->work = job_work(command);
+    job->parts = 1;
+    job->next_waiter = -1;
+
+    return job_id;
+}
+
+// takes the job at index in a client's queue; a client left without jobs
+// leaves the round and loses its deficit, as in deficit round robin. Called
+// with schedule_lock held
+int take_queued(PriorityClass *class, int client_id, int index) 
+{
+    ClientQueue *queue = &class->queues[client_id];
+    QueuedJob *queued = &queue->jobs[queue->head];
+    int job_id = queued[index].job_id;
+    if (index == 0) 
+    {
+        queue->head++;
+    }
+    else 
+    {
+        memmove(&queued[index], &queued[index + 1], (queue->count - index - 1) * sizeof(QueuedJob));
+    }
+    queue->count--;
+    class->queued--;
+
+    if (queue->count == 0) 
+    {
+        queue->head = 0;
+        queue->deficit = 0;
+        queue->active = 0;
+        int found = 0;
+        for (int i = 0; i + 1 < class->round_count; i++) 
+        {
+            int *position = &class->round[(class->round_head + i) % class->round_capacity];
+            found |= (*position == client_id);
+            if (found) 
+            {
+                *position = class->round[(class->round_head + i + 1) % class->round_capacity];
+            }
+        }
+        class->round_count--;
+    }
+    return job_id;
+}
+
+// deficit round robin on the estimated service time: the client at the front
+// of the round dispatches its oldest job if its deficit covers the estimate,
+// otherwise it gets a quantum and goes to the back; a run of rounds in which
+// nobody could dispatch is skipped in one step. Called with schedule_lock held
+int drr_pick(PriorityClass *class) 
+{
+    for (int visits = 0; ; visits++) 
+    {
+        if (visits == class->round_count) 
+        {
+            double rounds = INFINITY;
+            for (int i = 0; i < class->round_count; i++) 
+            {
+                ClientQueue *queue = &class->queues[class->round[(class->round_head + i) % class->round_capacity]];
+                QueuedJob *oldest = &queue->jobs[queue->head];
+                rounds = fmin(rounds, ceil((estimate_ms(oldest->opcode, oldest->work) - queue->deficit) / DRR_QUANTUM_MS));
+            }
+            for (int i = 0; i < class->round_count; i++) 
+            {
+                class->queues[class->round[(class->round_head + i) % class->round_capacity]].deficit += rounds * DRR_QUANTUM_MS;
+            }
+            visits = 0;
+        }
+
+        int client_id = class->round[class->round_head];
+        ClientQueue *queue = &class->queues[client_id];
+        QueuedJob *oldest = &queue->jobs[queue->head];
+        double estimate = estimate_ms(oldest->opcode, oldest->work);
+        if (queue->deficit >= estimate) 
+        {
+            queue->deficit -= estimate;
+            return take_queued(class, client_id, 0);
+        }
+
+        queue->deficit += DRR_QUANTUM_MS;
+        class->round[(class->round_head + class->round_count) % class->round_capacity] = client_id;
+        class->round_head = (class->round_head + 1) % class->round_capacity;
+    }
+}
+
+// the oldest, shortest or longest job of the class, whichever client it
+// belongs to, ties going to the older job; called with schedule_lock held
+int scan_pick(PriorityClass *class) 
+{
+    int best_client = -1, best_index = 0, best_job = 0;
+    double best = 0;
+    for (int r = 0; r < class->round_count; r++) 
+    {
+        int client_id = class->round[(class->round_head + r) % class->round_capacity];
+        ClientQueue *queue = &class->queues[client_id];
+
+        // a client's jobs are in arrival order, so only its oldest can be the oldest overall
+        int count = schedule_policy == POLICY_FIFO ? 1 : queue->count;
+        for (int i = 0; i < count; i++) 
+        {
+            QueuedJob *queued = &queue->jobs[queue->head + i];
+            double key = schedule_policy == POLICY_FIFO ? queued->job_id : estimate_ms(queued->opcode, queued->work);
+            int better = schedule_policy == POLICY_LPT ? key > best : key < best;
+            if (best_client < 0 || better || (key == best && queued->job_id < best_job)) 
+            {
+                best_client = client_id;
+                best_index = i;
+                best_job = queued->job_id;
+                best = key;
+            }
+        }
+    }
+    return take_queued(class, best_client, best_index);
+}
+
+// removes and returns the job the policy prefers from the first priority
+// class with jobs waiting, waiting for the input thread if there are none; a
+// command to send again goes first and is returned in retry, with -2.
+// Returns -1 once the input is exhausted and nothing in flight can still
+// come back
+int next_job(Dispatch *retry) 
+{
+    pthread_mutex_lock(&schedule_lock);
+    while (queued_jobs == 0 && retry_count == 0 && 
+           (!__atomic_load_n(&input_done, __ATOMIC_ACQUIRE) || __atomic_load_n(&coalesced_count, __ATOMIC_RELAXED) > 0 || __atomic_load_n(&in_flight, __ATOMIC_RELAXED) > 0)) 
+    {
+        pthread_cond_wait(&job_queued, &schedule_lock);
+    }
+    if (retry_count > 0) 
+    {
+        *retry = retries[retry_head];
+        retry_head = (retry_head + 1) % dispatch_capacity;
+        retry_count--;
+        pthread_mutex_unlock(&schedule_lock);
+        return -2;
+    }
+    if (queued_jobs == 0) 
+    {
+        pthread_mutex_unlock(&schedule_lock);
+        return -1;
+    }
+
+    PriorityClass *class = priority_classes;
+    while (class->queued == 0) 
+    {
+        class++;
+    }
+    int job_id = schedule_policy == POLICY_DRR ? drr_pick(class) : scan_pick(class);
+    queued_jobs--;
+    pthread_cond_signal(&job_taken);
+    pthread_mutex_unlock(&schedule_lock);
+
+    return job_id;
+}
+
+// sends a command already tracked
+void post_dispatch(int worker_id, Dispatch *dispatch) 
+{
+    MPI_Send(&dispatch->command, command_length(&dispatch->command), MPI_BYTE, worker_id, TAG_COMMAND, MPI_COMM_WORLD);
+    log_event(EVENT_DISPATCHED, dispatch->command.job_id, worker_id, dispatch->part, dispatch->estimate_ms);
+}
+
+// sends a command under a deadline, to another worker if this one was
+// excluded after its credit was taken
+void send_dispatch(int worker_id, Dispatch *dispatch) 
+{
+    while (1) 
+    {
+        pthread_mutex_lock(&lock);
+        int tracked = track_dispatch(worker_id, dispatch);
+        pthread_mutex_unlock(&lock);
+        if (tracked) 
+        {
+            break;
+        }
+        worker_id = acquire_worker();
+    }
+    post_dispatch(worker_id, dispatch);
+}
+
+void send_to_worker(int worker_id, Command *command, int part, double estimate_ms) 
+{
+    Dispatch dispatch = { .command = *command, .part = part, .estimate_ms = estimate_ms };
+    send_dispatch(worker_id, &dispatch);
+}
+
+// splits PRIMES n into segment-aligned [low, high) ranges, one per worker
+// thread, and scatters them; the first part goes to the worker already acquired and
+// the receiver sums the parts and writes a single result; returns the time
+// spent waiting for credits for the other parts
+double dispatch_split_primes(int worker_id, int job_id) 
+{
+    pthread_mutex_lock(&lock);
+    Job *job = &jobs[job_id];
+    Command part = job->command;
+    double estimate_ms = job_estimate_ms(job);
+
+    long long n = part.arg;
+    long long span = (n + 1 + total_worker_threads - 1) / total_worker_threads;
+    span = (span + SIEVE_SEGMENT_SPAN - 1) / SIEVE_SEGMENT_SPAN * SIEVE_SEGMENT_SPAN;
+    int parts = (n + 1 + span - 1) / span;
+    job->parts = parts;
+    pthread_mutex_unlock(&lock);
+
+    part.opcode = OP_PRIMES_RANGE;
+
+    double waited_ms = 0;
+    for (int p = 0; p < parts; p++) 
+    {
+        if (p > 0) 
+        {
+            struct timespec waiting;
+            clock_gettime(CLOCK_MONOTONIC, &waiting);
+            worker_id = acquire_worker();
+            waited_ms += elapsed_ms(&waiting);
+        }
+        part.arg = p * span;
+        part.arg2 = (p == parts - 1) ? n + 1 : part.arg + span;
+        send_to_worker(worker_id, &part, p, estimate_ms / parts);
+    }
+
+    return waited_ms;
+}
+
+void ingest_command(char *line, int line_number, uint64_t received_ns) 
+{
+    Command command;
+    if (!encode_command(line, &command)) 
+    {
+        log_event(EVENT_UNKNOWN, line_number, -1, 0, 0);
+        return;
+    }
+
+    // only this thread queues new jobs, so the room waited for is still there
+    pthread_mutex_lock(&schedule_lock);
+    while (queued_jobs >= MAX_PENDING_JOBS) 
+    {
+        pthread_cond_wait(&job_taken, &schedule_lock);
+    }
+    pthread_mutex_unlock(&schedule_lock);
+
+    // logged before the scheduler can see the job, so its events stay in order
+    pthread_mutex_lock(&lock);
+    int job_id = add_job(&command, line, received_ns);
+    log_event(EVENT_RECEIVED, job_id, -1, 0, 0);
+    pthread_mutex_lock(&schedule_lock);
+    schedule_job(&jobs[job_id]);
+    pthread_mutex_unlock(&schedule_lock);
+    pthread_mutex_unlock(&lock);
+}
+
+// open-loop load: Poisson arrivals at arrival_rate, each a command drawn at
+// random from the file; arrivals never wait for the cluster to catch up
+void generate_load(char (*lines)[BUFFER_SIZE], int line_count) 
+{
+    unsigned int seed = LOAD_SEED;
+    uint64_t arrival_ns = monotonic_ns();
+    for (int i = 0; i < generated_jobs; i++) 
+    {
+        double uniform = (rand_r(&seed) + 1.0) / ((double)RAND_MAX + 2.0);
+        arrival_ns += (uint64_t)(-log(uniform) / arrival_rate * 1e9);
+        ingest_command(lines[rand_r(&seed) % line_count], i + 1, sleep_until(arrival_ns));
+    }
+}
+
+// feeds the scheduler from a file: all of it at once by default, so it can
+// choose among every job, or on the trace's own schedule when replaying,
+// or as generated load
+void read_command_file(char *path) 
+{
+    FILE *input_file = fopen(path, "r");
+    if (!input_file)
+    {
+        perror("failed to open commands file parallel");
+        exit(EXIT_FAILURE);
+    }
+
+    char (*lines)[BUFFER_SIZE] = NULL;
+    int line_count = 0, line_capacity = 0;
+    char *buffer = (char*) malloc(BUFFER_SIZE);
+    if (!buffer) 
+    {
+        perror("failed to allocate memory for buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    // WAITs add up to a schedule relative to the start, so time spent
+    // ingesting does not stretch the trace
+    uint64_t start_ns = monotonic_ns();
+    uint64_t offset_ns = 0;
+    while (fgets(buffer, BUFFER_SIZE, input_file)) 
+    {
+        int line = ++line_number;
+        double wait = wait_seconds(buffer);
+        if (wait >= 0) 
+        {
+            offset_ns += (uint64_t)(wait * 1e9);
+            continue;
+        }
+
+        if (arrival_rate > 0) 
+        {
+            if (line_count == line_capacity) 
+            {
+                line_capacity = line_capacity ? 2 * line_capacity : 64;
+                lines = realloc(lines, line_capacity * sizeof(*lines));
+                if (!lines) 
+                {
+                    perror("failed to allocate memory for command lines");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            strcpy(lines[line_count++], buffer);
+            continue;
+        }
+
+        ingest_command(buffer, line, replay_trace ? sleep_until(start_ns + offset_ns) : monotonic_ns());
+    }
+    fclose(input_file);
+
+    if (arrival_rate > 0 && line_count > 0) 
+    {
+        if (generated_jobs == 0) 
+        {
+            generated_jobs = line_count;
+        }
+        generate_load(lines, line_count);
+    }
+
+    free(lines);
+    free(buffer);
+}
+
+// one line of a command stream; returns 0 for SHUTDOWN. Commands arrive in
+// real time here, so WAIT lines mean nothing and are skipped
+int handle_stream_line(char *line) 
+{
+    line[strcspn(line, "\r")] = '\0';
+    int number = ++line_number;
+    if (strcmp(line, "SHUTDOWN") == 0) 
+    {
+        return 0;
+    }
+    if (line[0] == '\0' || wait_seconds(line) >= 0) 
+    {
+        return 1;
+    }
+    ingest_command(line, number, monotonic_ns());
+    return 1;
+}
+
+// reads what the stream has and ingests every complete line; returns 1 while
+// the stream is open, 0 at end of stream and -1 after SHUTDOWN
+int read_command_stream(LineReader *reader) 
+{
+    ssize_t got = read(reader->fd, reader->data + reader->used, sizeof(reader->data) - 1 - reader->used);
+    if (got < 0 && errno == EINTR) 
+    {
+        return 1;
+    }
+    if (got <= 0) 
+    {
+        return 0;
+    }
+    reader->used += got;
+
+    char *start = reader->data;
+    char *end;
+    while ((end = memchr(start, '\n', reader->data + reader->used - start))) 
+    {
+        *end = '\0';
+        if (reader->overlong) 
+        {
+            reader->overlong = 0;
+            log_event(EVENT_UNKNOWN, ++line_number, -1, 0, 0);
+        }
+        else if (!handle_stream_line(start)) 
+        {
+            return -1;
+        }
+        start = end + 1;
+    }
+
+    reader->used -= start - reader->data;
+    memmove(reader->data, start, reader->used);
+    if (reader->used == sizeof(reader->data) - 1) 
+    {
+        reader->overlong = 1;
+        reader->used = 0;
+    }
+    return 1;
+}
+
+// stdin or a named pipe; a pipe is opened again whenever its last writer
+// leaves, so the server keeps running until SHUTDOWN
+void serve_stream(char *path) 
+{
+    int is_stdin = strcmp(path, "-") == 0;
+    LineReader *reader = (LineReader*) calloc(1, sizeof(LineReader));
+    if (!reader) 
+    {
+        perror("failed to allocate memory for command stream");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) 
+    {
+        reader->fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+        if (reader->fd < 0) 
+        {
+            perror("failed to open command stream");
+            break;
+        }
+        reader->used = 0;
+        reader->overlong = 0;
+
+        int state;
+        while ((state = read_command_stream(reader)) > 0) 
+        {
+        }
+        if (!is_stdin) 
+        {
+            close(reader->fd);
+        }
+        if (state < 0 || is_stdin) 
+        {
+            break;
+        }
+    }
+
+    free(reader);
+}
+
+// a local socket any number of clients can connect to and send command lines;
+// the server stops taking commands when one of them sends SHUTDOWN
+void serve_socket(char *path) 
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listener, MAX_STREAM_CLIENTS) < 0) 
+    {
+        perror("failed to listen on command socket");
+        exit(EXIT_FAILURE);
+    }
+
+    struct pollfd polled[MAX_STREAM_CLIENTS + 1];
+    LineReader *readers[MAX_STREAM_CLIENTS + 1];
+    int count = 1;
+    polled[0].fd = listener;
+
+    int running = 1;
+    while (running) 
+    {
+        // the listener is left out while full, so further clients wait in the backlog
+        polled[0].events = count <= MAX_STREAM_CLIENTS ? POLLIN : 0;
+        if (poll(polled, count, -1) < 0) 
+        {
+            if (errno == EINTR) 
+            {
+                continue;
+            }
+            perror("failed to poll command socket");
+            break;
+        }
+
+        for (int i = count - 1; i >= 1 && running; i--) 
+        {
+            if (!polled[i].revents) 
+            {
+                continue;
+            }
+            int state = read_command_stream(readers[i]);
+            if (state < 0) 
+            {
+                running = 0;
+            }
+            else if (state == 0) 
+            {
+                close(polled[i].fd);
+                free(readers[i]);
+                count--;
+                polled[i] = polled[count];
+                readers[i] = readers[count];
+            }
+        }
+
+        if (running && (polled[0].revents & POLLIN)) 
+        {
+            int client = accept(listener, NULL, NULL);
+            LineReader *reader = client >= 0 ? (LineReader*) calloc(1, sizeof(LineReader)) : NULL;
+            if (reader) 
+            {
+                reader->fd = client;
+                polled[count].fd = client;
+                polled[count].events = POLLIN;
+                readers[count] = reader;
+                count++;
+            }
+            else if (client >= 0) 
+            {
+                close(client);
+            }
+        }
+    }
+
+    for (int i = 1; i < count; i++) 
+    {
+        close(polled[i].fd);
+        free(readers[i]);
+    }
+    close(listener);
+    unlink(path);
+}
+
+int is_command_stream(char *path) 
+{
+    struct stat info;
+    return strcmp(path, "-") == 0 || strncmp(path, "unix:", 5) == 0 || (stat(path, &info) == 0 && S_ISFIFO(info.st_mode));
+}
+
+void *input_thread(void *arg) 
+{
+    if (strncmp(input_path, "unix:", 5) == 0) 
+    {
+        serve_socket(input_path + 5);
+    }
+    else if (is_command_stream(input_path)) 
+    {
+        serve_stream(input_path);
+    }
+    else 
+    {
+        read_command_file(input_path);
+    }
+
+    __atomic_store_n(&input_done, 1, __ATOMIC_RELEASE);
+    wake_scheduler();
+
+    return NULL;
+}
+
+// the job is picked only once a worker credit is in hand, so the policy
+// decides among everything that arrived while the workers were busy
+void *send_thread(void *arg) 
+{
+    while (1) 
+    {
+        struct timespec waiting, dispatching;
+        clock_gettime(CLOCK_MONOTONIC, &waiting);
+        int worker_id = acquire_worker();
+        credit_wait_ms += elapsed_ms(&waiting);
+
+        Dispatch retry;
+        int job_id = next_job(&retry);
+        if (job_id == -2) 
+        {
+            send_dispatch(avoid_worker(worker_id, retry.worker_id), &retry);
+            continue;
+        }
+        if (job_id < 0) 
+        {
+            release_worker(worker_id);
+            break;
+        }
+
+        // admission and tracking share one pass over the job table, which
+        // add_job may move; a PRIMES job to split is tracked part by part
+        clock_gettime(CLOCK_MONOTONIC, &dispatching);
+        pthread_mutex_lock(&lock);
+        int admitted = admit_job(job_id);
+        Job job = jobs[job_id];
+        int split = job.command.opcode == OP_PRIMES && total_worker_threads > 1 && job.command.arg + 1 >= PRIMES_SPLIT_MIN;
+        Dispatch dispatch = { .command = job.command, .estimate_ms = job_estimate_ms(&job) };
+        int tracked = admitted == ADMIT_DISPATCH && !split && track_dispatch(worker_id, &dispatch);
+        pthread_mutex_unlock(&lock);
+
+        if (admitted != ADMIT_DISPATCH) 
+        {
+            release_worker(worker_id);
+
+            log_event(admitted == ADMIT_HIT ? EVENT_CACHE_HIT : EVENT_COALESCED, job_id, -1, 0, 0);
+
+            // client files are written by the receiver alone, so hand it the job
+            if (admitted == ADMIT_HIT) 
+            {
+                ResultMessage hit = { .client_id = job.command.client_id, .job_id = job_id };
+                MPI_Send(&hit, offsetof(ResultMessage, text), MPI_BYTE, 0, TAG_CACHED, MPI_COMM_WORLD);
+            }
+            continue;
+        }
+
+        dispatched_jobs++;
+
+        if (split) 
+        {
+            double waited_ms = dispatch_split_primes(worker_id, job_id);
+            credit_wait_ms += waited_ms;
+            dispatch_ms -= waited_ms;
+        }
+        else if (tracked) 
+        {
+            post_dispatch(worker_id, &dispatch);
+        }
+        else 
+        {
+            // the worker was excluded after its credit was taken
+            send_dispatch(acquire_worker(), &dispatch);
+        }
+        dispatch_ms += elapsed_ms(&dispatching);
+    }
+
+    wait_for_all_workers();
+
+    Command stop = {0};
+    stop.opcode = OP_STOP;
+    for (int i = 1; i <= num_workers; i++) 
+    {
+        MPI_Send(&stop, command_length(&stop), MPI_BYTE, i, TAG_COMMAND, MPI_COMM_WORLD);
+    }
+
+    return NULL;
+}
+
+int compare_doubles(const void *a, const void *b) 
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// one row of the latency table: response time, arrival to result, of the
+// completed jobs that match
+void report_latency_row(char *name, double *latencies, int opcode, int client_id) 
+{
+    int count = 0;
+    for (int j = 0; j < job_count; j++) 
+    {
+        if ((opcode < 0 || jobs[j].command.opcode == opcode) && (client_id < 0 || jobs[j].command.client_id == client_id) && jobs[j].completed_ns) 
+        {
+            latencies[count++] = (jobs[j].completed_ns - jobs[j].received_ns) / 1e6;
+        }
+    }
+    if (count == 0) 
+    {
+        return;
+    }
+
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    // nearest rank
+    double p50 = latencies[(int)ceil(0.50 * count) - 1];
+    double p95 = latencies[(int)ceil(0.95 * count) - 1];
+    double p99 = latencies[(int)ceil(0.99 * count) - 1];
+    printf("%-14s %6d %10.3f %10.3f %10.3f %10.3f\n", name, count, p50, p95, p99, latencies[count - 1]);
+    if (!binary_log) 
+    {
+        fprintf(log_file, "Latency of %s: %d jobs, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n", name, count, p50, p95, p99, latencies[count - 1]);
+    }
+}
+
+// by command type, then by client, which shows whether the scheduling is fair
+void report_latencies() 
+{
+    static char *names[] = { [OP_PRIMES] = "PRIMES", [OP_PRIMEDIVISORS] = "PRIMEDIVISORS", [OP_ANAGRAMS] = "ANAGRAMS" };
+    double *latencies = (double*) malloc((job_count + 1) * sizeof(double));
+    if (!latencies) 
+    {
+        perror("failed to allocate memory for latencies");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-14s %6s %10s %10s %10s %10s (latency in ms)\n", "command", "jobs", "p50", "p95", "p99", "max");
+    for (int opcode = OP_PRIMES; opcode <= OP_ANAGRAMS; opcode++) 
+    {
+        report_latency_row(names[opcode], latencies, opcode, -1);
+    }
+    printf("%-14s %6s %10s %10s %10s %10s\n", "client", "jobs", "p50", "p95", "p99", "max");
+    for (int c = 0; c < client_count; c++) 
+    {
+        report_latency_row(client_names[c], latencies, -1, c);
+    }
+
+    // a job completes when its result is queued for the writer, so the time
+    // from there to the client file comes on top of the latencies above
+    double mean_ms = client_writes.written ? client_writes.wait_ns / 1e6 / client_writes.written : 0.0;
+    printf("Client writes: %ld, %.3f ms mean and %.3f ms max from queue to file, not in the latencies above\n",
+           client_writes.written, mean_ms, client_writes.max_wait_ns / 1e6);
+    if (!binary_log) 
+    {
+        fprintf(log_file, "Client writes: %ld, queue to file mean %.3f ms, max %.3f ms\n", client_writes.written, mean_ms, client_writes.max_wait_ns / 1e6);
+    }
+
+    free(latencies);
+}
+
+long long draw_size(unsigned int *seed, long long low, long long high) 
+{
+    double uniform = rand_r(seed) / ((double)RAND_MAX + 1.0);
+    if (benchmark_log_sizes) 
+    {
+        return (long long)exp(log((double)low) + uniform * (log((double)high) - log((double)low)));
+    }
+    return low + (long long)(uniform * (high - low + 1));
+}
+
+// writes a random command list with the configured mix, without WAITs, so
+// both runs measure throughput alone
+void generate_benchmark(char *path) 
+{
+    int weights[3] = {0};
+    if (sscanf(benchmark_mix, "%d:%d:%d", &weights[0], &weights[1], &weights[2]) != 3 || weights[0] < 0 || weights[1] < 0 || weights[2] < 0 || weights[0] + weights[1] + weights[2] == 0) 
+    {
+        fprintf(stderr, "MIX must be PRIMES:PRIMEDIVISORS:ANAGRAMS weights, got %s\n", benchmark_mix);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *file = fopen(path, "w");
+    if (!file) 
+    {
+        perror("failed to create benchmark commands");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned int seed = LOAD_SEED;
+    for (int i = 0; i < benchmark_jobs; i++) 
+    {
+        int pick = rand_r(&seed) % (weights[0] + weights[1] + weights[2]);
+        fprintf(file, "CLI%d ", rand_r(&seed) % 10);
+        if (pick < weights[0]) 
+        {
+            fprintf(file, "PRIMES %lld\n", draw_size(&seed, 1000, BENCHMARK_PRIMES_MAX));
+        }
+        else if (pick < weights[0] + weights[1]) 
+        {
+            fprintf(file, "PRIMEDIVISORS %lld\n", draw_size(&seed, 2, 1LL << 62));
+        }
+        else 
+        {
+            char word[BENCHMARK_WORD_MAX + 1];
+            int length = draw_size(&seed, BENCHMARK_WORD_MIN, BENCHMARK_WORD_MAX);
+            for (int k = 0; k < length; k++) 
+            {
+                word[k] = 'a' + rand_r(&seed) % 26;
+            }
+            word[length] = '\0';
+            fprintf(file, "ANAGRAMS %s\n", word);
+        }
+    }
+    fclose(file);
+}
+
+// one JSON object per run; the serial time is the same commands on one
+// process, and neither time includes MPI start-up or shutdown
+void write_benchmark_report() 
+{
+    static const char *names[] = { [OP_PRIMES] = "PRIMES", [OP_PRIMEDIVISORS] = "PRIMEDIVISORS", [OP_ANAGRAMS] = "ANAGRAMS" };
+    FILE *report = fopen(BENCHMARK_REPORT, "w");
+    if (!report) 
+    {
+        perror("failed to create benchmark report");
+        return;
+    }
+
+    fprintf(report, "{\n  \"mode\": \"%s\",\n  \"workers\": %d,\n  \"worker_threads\": %d,\n  \"jobs\": %d,\n  \"mix\": \"%s\",\n  \"sizes\": \"%s\",\n",
+            local_mode ? "local" : "cluster", local_mode ? 0 : num_workers, local_mode ? local_run.threads : total_worker_threads,
+            local_mode ? local_run.count : job_count, benchmark_mix, benchmark_log_sizes ? "log-uniform" : "uniform");
+
+    // the local executor keeps no job table, so its report ends with the throughput
+    if (local_mode) 
+    {
+        fprintf(report, "  \"serial_seconds\": %.6f,\n  \"local_seconds\": %.6f,\n", serial_seconds, local_seconds);
+        fprintf(report, "  \"serial_jobs_per_second\": %.3f,\n  \"local_jobs_per_second\": %.3f,\n  \"speedup\": %.3f\n}\n",
+                serial_seconds > 0 ? local_run.count / serial_seconds : 0.0, local_seconds > 0 ? local_run.count / local_seconds : 0.0,
+                local_seconds > 0 ? serial_seconds / local_seconds : 0.0);
+        fclose(report);
+        return;
+    }
+    fprintf(report, "  \"serial_seconds\": %.6f,\n  \"cluster_seconds\": %.6f,\n", serial_seconds, cluster_seconds);
+    fprintf(report, "  \"serial_jobs_per_second\": %.3f,\n  \"cluster_jobs_per_second\": %.3f,\n  \"speedup\": %.3f,\n",
+            serial_seconds > 0 ? job_count / serial_seconds : 0.0, cluster_seconds > 0 ? job_count / cluster_seconds : 0.0,
+            cluster_seconds > 0 ? serial_seconds / cluster_seconds : 0.0);
+
+    fprintf(report, "  \"types\": {");
+    const char *separator = "";
+    for (int opcode = OP_PRIMES; opcode <= OP_ANAGRAMS; opcode++) 
+    {
+        int count = 0, computed = 0;
+        double service_ms = 0, latency_ms = 0;
+        for (int j = 0; j < job_count; j++) 
+        {
+            if (jobs[j].command.opcode != opcode) 
+            {
+                continue;
+            }
+            count++;
+            latency_ms += (jobs[j].completed_ns - jobs[j].received_ns) / 1e6;
+            if (jobs[j].parts_done == jobs[j].parts) 
+            {
+                computed++;
+                service_ms += jobs[j].service_ms;
+            }
+        }
+        fprintf(report, "%s\n    \"%s\": { \"jobs\": %d, \"computed\": %d, \"mean_service_ms\": %.3f, \"mean_latency_ms\": %.3f }",
+                separator, names[opcode], count, computed, computed ? service_ms / computed : 0.0, count ? latency_ms / count : 0.0);
+        separator = ",";
+    }
+    fprintf(report, "\n  },\n");
+
+    // busy time over the time its threads were available
+    fprintf(report, "  \"worker_utilization\": [");
+    for (int w = 1; w <= num_workers; w++) 
+    {
+        double available_ms = cluster_seconds * 1e3 * worker_capacity[w];
+        fprintf(report, "%s%.3f", w > 1 ? ", " : "", available_ms > 0 ? worker_busy_ms[w] / available_ms : 0.0);
+    }
+    fprintf(report, "]\n}\n");
+    fclose(report);
+}
+
+// runs one command on a thread of the local executor. With no receiver to
+// order results, the threads share its client output queues: an anagram
+// stream is generated chunk by chunk into the thread's own buffer and the
+// output lock is taken only to hand each chunk on, other results for the
+// client being held until the stream is done, as in the cluster
+void execute_local_command(Command *command) 
+{
+    char text[BUFFER_SIZE];
+    if (command->opcode == OP_ANAGRAMS && anagram_bytes(command->word) <= ANAGRAM_OUTPUT_LIMIT) 
+    {
+        AnagramStream stream;
+        anagram_stream_init(&stream, command->word);
+
+        pthread_mutex_lock(&local_run.output_lock);
+        ClientOutput *output = open_output(command->client_id);
+        pthread_mutex_unlock(&local_run.output_lock);
+
+        int length = snprintf(text, sizeof(text), "Anagrams of %s are: ", command->word);
+        while (!stream.done) 
+        {
+            length += anagram_stream_fill(&stream, text + length, sizeof(text) - length);
+            pthread_mutex_lock(&local_run.output_lock);
+            output_text(output, text, length);
+            pthread_mutex_unlock(&local_run.output_lock);
+            length = 0;
+        }
+
+        pthread_mutex_lock(&local_run.output_lock);
+        output_text(output, "\n", 1);
+        close_output(output);
+        pthread_mutex_unlock(&local_run.output_lock);
+        return;
+    }
+
+    int length;
+    if (command->opcode == OP_PRIMES) 
+    {
+        long long count = count_primes(command->arg);
+        length = snprintf(text, sizeof(text), "Found %lld primes in the first %lld numbers.\n", count, (long long)command->arg);
+    } 
+    else if (command->opcode == OP_ANAGRAMS) 
+    {
+        length = snprintf(text, sizeof(text), "Too many anagrams of %s to list, the limit is %lld MB.\n", command->word, ANAGRAM_OUTPUT_LIMIT >> 20);
+    }
+    else 
+    {
+        int count = count_prime_divisors((uint64_t)command->arg);
+        length = snprintf(text, sizeof(text), "Found %d prime divisors of %llu.\n", count, (unsigned long long)command->arg);
+    }
+
+    pthread_mutex_lock(&local_run.output_lock);
+    deliver_result(command->client_id, text, length);
+    pthread_mutex_unlock(&local_run.output_lock);
+}
+
+void *local_thread(void *arg) 
+{
+    while (1) 
+    {
+        int next = __atomic_fetch_add(&local_run.next, 1, __ATOMIC_RELAXED);
+        if (next >= local_run.count) 
+        {
+            break;
+        }
+        execute_local_command(&local_run.commands[next]);
+    }
+    return NULL;
+}
+
+// the command file on a pool of threads in this process, one per core unless
+// -t says otherwise; the results reach the client files through the writer
+// thread, as the cluster's do. WAIT lines are skipped, unknown commands too
+void compute_local() 
+{
+    FILE *commands_file = fopen(input_path, "r");
+    if (!commands_file) 
+    {
+        perror("failed to open commands file local");
+        exit(EXIT_FAILURE);
+    }
+
+    char buffer[BUFFER_SIZE];
+    while (fgets(buffer, sizeof(buffer), commands_file)) 
+    {
+        if (local_run.count == local_run.capacity) 
+        {
+            local_run.capacity = local_run.capacity ? 2 * local_run.capacity : 1024;
+            local_run.commands = (Command*) realloc(local_run.commands, local_run.capacity * sizeof(Command));
+            if (!local_run.commands) 
+            {
+                perror("failed to allocate memory for local commands");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (wait_seconds(buffer) < 0 && encode_command(buffer, &local_run.commands[local_run.count])) 
+        {
+            local_run.count++;
+        }
+    }
+    fclose(commands_file);
+
+    local_run.threads = worker_threads ? worker_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads = (pthread_t*) malloc(local_run.threads * sizeof(pthread_t));
+    if (!threads) 
+    {
+        perror("failed to allocate memory for local threads");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t writer_tid;
+    pthread_create(&writer_tid, NULL, writer_thread, NULL);
+    for (int i = 0; i < local_run.threads; i++) 
+    {
+        pthread_create(&threads[i], NULL, local_thread, NULL);
+    }
+    for (int i = 0; i < local_run.threads; i++) 
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_lock(&client_writes.lock);
+    client_writes.stopping = 1;
+    pthread_cond_signal(&client_writes.ready);
+    pthread_mutex_unlock(&client_writes.lock);
+    pthread_join(writer_tid, NULL);
+
+    // every result was closed, so the queues are empty
+    free(output_queues);
+    output_queues = NULL;
+    output_queue_count = 0;
+    free(threads);
+    free(local_run.commands);
+}
+
+void main_server_process(int num_workers)
+ {
+    pthread_t input_tid, send_tid, recv_tid, writer_tid, log_tid, watchdog_tid;
+
+    initialize_workers();
+
+    log_file = fopen(binary_log ? LOG_FILE_BINARY : LOG_FILE_P, binary_log ? "wb" : "w");
+    if (!log_file) 
+    {
+        perror("faield to open log file parallel");
+        exit(EXIT_FAILURE);
+    }
+    log_epoch_ns = monotonic_ns();
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    pthread_create(&log_tid, NULL, log_thread, NULL);
+    pthread_create(&input_tid, NULL, input_thread, NULL);
+    pthread_create(&send_tid, NULL, send_thread, NULL);
+    pthread_create(&recv_tid, NULL, receive_thread, NULL);
+    pthread_create(&writer_tid, NULL, writer_thread, NULL);
+    pthread_create(&watchdog_tid, NULL, watchdog_thread, NULL);
+
+    pthread_join(input_tid, NULL);
+    pthread_join(send_tid, NULL);
+    pthread_join(recv_tid, NULL);
+    pthread_mutex_lock(&lock);
+    watchdog_stopping = 1;
+    pthread_cond_signal(&watchdog_wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(watchdog_tid, NULL);
+
+    pthread_mutex_lock(&client_writes.lock);
+    client_writes.stopping = 1;
+    pthread_cond_signal(&client_writes.ready);
+    pthread_mutex_unlock(&client_writes.lock);
+    pthread_join(writer_tid, NULL);
+    cluster_seconds = elapsed_ms(&started) / 1e3;
+
+    __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(log_tid, NULL);
+
+    // a dispatcher that keeps up spends its time waiting for workers, not dispatching
+    printf("Dispatcher: %d jobs to %d workers (%d threads), %.3f ms dispatching (%.3f ms per job), %.3f ms waiting for free workers\n",
+           dispatched_jobs, num_workers, total_worker_threads, dispatch_ms, dispatched_jobs ? dispatch_ms / dispatched_jobs : 0.0, credit_wait_ms);
+
+    report_latencies();
+
+    printf("Faults: %d timeouts, %d commands sent again, %d jobs failed, %d cancelled, %d workers excluded\n",
+           timed_out_count, retried_count, failed_count, cancelled_count, num_workers - live_workers);
+    if (abandoned_workers) 
+    {
+        fprintf(stderr, "%d workers never stopped, a command that timed out is still running on them\n", abandoned_workers);
+    }
+
+    long lookups = result_cache.hits + result_cache.coalesced + result_cache.misses;
+    printf("Result cache: %ld hits, %ld coalesced, %ld misses (%.1f%% not computed), %d entries in %zu bytes\n",
+           result_cache.hits, result_cache.coalesced, result_cache.misses,
+           lookups ? 100.0 * (result_cache.hits + result_cache.coalesced) / lookups : 0.0, result_cache.entries, result_cache.bytes);
+    if (!binary_log) 
+    {
+        fprintf(log_file, "Result cache: %ld hits, %ld coalesced, %ld misses\n", result_cache.hits, result_cache.coalesced, result_cache.misses);
+    }
+
+    if (benchmark_jobs) 
+    {
+        write_benchmark_report();
     }
-    return 1;
-}
 
-int count_primes(int n) 
-{
-    int count = 0;
-    for (int i = 1; i <= n; i++) 
+    fclose(log_file);
+    for (int b = 0; b < RESULT_CACHE_BUCKETS; b++) 
     {
-        if (is_prime(i)) 
+        while (result_cache.buckets[b]) 
         {
-            count++;
+            CacheEntry *entry = result_cache.buckets[b];
+            result_cache.buckets[b] = entry->next;
+            free(entry->text);
+            free(entry);
         }
     }
-    return count;
-}
-
-int count_prime_divisors(int n) 
-{
-    int count = 0;
-    for (int i = 2; i <= n; i++) 
+    free(jobs);
+    for (int k = 0; k < PRIORITY_CLASSES; k++) 
     {
-        if (n % i == 0 && is_prime(i)) 
+        for (int c = 0; c < priority_classes[k].queue_count; c++) 
         {
-            count++;
+            free(priority_classes[k].queues[c].jobs);
         }
+        free(priority_classes[k].queues);
+        free(priority_classes[k].round);
     }
-    return count;
+    free(client_names);
+    free(free_workers);
+    free(worker_capacity);
+    free(worker_busy_ms);
+    free(worker_health);
+    free(dispatches);
+    free(retries);
+    free(free_slots);
 }
 
-
-void generate_anagrams_rec(char *str, int start, int end, char **result, int *offset, int *capacity) 
+void parse_options(int argc, char *argv[]) 
 {
-    if (start == end) 
+    int option;
+    while ((option = getopt(argc, argv, "B:bc:d:g:i:LlP:m:n:p:rSs:t:")) != -1) 
     {
-        int len = strlen(str) + 1;
-
-        while (*offset + len >= *capacity) 
+        switch (option) 
         {
-            *capacity *= 2;
-            *result = realloc(*result, *capacity);
-            if (*result == NULL) 
+        case 'B':
+            benchmark_jobs = atoi(optarg);
+            break;
+        case 'b':
+            binary_log = 1;
+            break;
+        case 'L':
+            local_mode = 1;
+            break;
+        case 'l':
+            benchmark_log_sizes = 1;
+            break;
+        case 'm':
+            benchmark_mix = optarg;
+            break;
+        case 'P':
+            if (sscanf(optarg, "%d:%d:%d", &command_class[OP_PRIMES], &command_class[OP_PRIMEDIVISORS], &command_class[OP_ANAGRAMS]) != 3) 
             {
-                perror("fail reallocating result anagrams");
+                fprintf(stderr, "CLASSES must be PRIMES:PRIMEDIVISORS:ANAGRAMS priority classes, got %s\n", optarg);
                 exit(EXIT_FAILURE);
             }
-        }
-
-        snprintf(*result + *offset, *capacity - *offset, "%s\n", str);
-        *offset += len;
-    } 
-    else 
-    {
-        for (int i = start; i <= end; i++) 
-        {
-            char temp = str[start];
-            str[start] = str[i];
-            str[i] = temp;
-
-            generate_anagrams_rec(str, start + 1, end, result, offset, capacity);
-
-            temp = str[start];
-            str[start] = str[i];
-            str[i] = temp;
+            break;
+        case 'c':
+            result_cache.budget = (size_t)atol(optarg) << 20;
+            break;
+        case 'd':
+            deadline_min_ms = (int)(atof(optarg) * 1e3);
+            break;
+        case 'g':
+            arrival_rate = atof(optarg);
+            break;
+        case 'i':
+            input_path = optarg;
+            break;
+        case 'n':
+            generated_jobs = atoi(optarg);
+            break;
+        case 'p':
+            prefetch_depth = atoi(optarg);
+            break;
+        case 'r':
+            replay_trace = 1;
+            break;
+        case 'S':
+            shared_transport = 1;
+            break;
+        case 't':
+            worker_threads = atoi(optarg);
+            if (worker_threads < 1) 
+            {
+                fprintf(stderr, "THREADS must be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "fifo") == 0) 
+            {
+                schedule_policy = POLICY_FIFO;
+            }
+            else if (strcmp(optarg, "sjf") == 0) 
+            {
+                schedule_policy = POLICY_SJF;
+            }
+            else if (strcmp(optarg, "lpt") == 0) 
+            {
+                schedule_policy = POLICY_LPT;
+            }
+            else if (strcmp(optarg, "drr") == 0) 
+            {
+                schedule_policy = POLICY_DRR;
+            }
+            else 
+            {
+                fprintf(stderr, "Unknown scheduling policy: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-L] [-B JOBS [-m MIX] [-l]] [-b] [-c CACHE_MB] [-d DEADLINE_SECONDS] [-g JOBS_PER_SECOND [-n JOBS]] [-i COMMANDS|-|unix:PATH] [-P CLASSES] [-p PREFETCH_DEPTH] [-r] [-S] [-s drr|fifo|sjf|lpt] [-t THREADS]\n", argv[0]);
+            exit(EXIT_FAILURE);
         }
     }
-}
 
-char *generate_anagrams_return(char *str) 
-{
-    int offset = 0;
-    int capacity = BUFFER_SIZE;
-    char *result = (char*) malloc(capacity);
-    if (!result) 
+    if (prefetch_depth < 1) 
     {
-        perror("fail allocating anagrams result");
+        fprintf(stderr, "PREFETCH_DEPTH must be at least 1\n");
         exit(EXIT_FAILURE);
     }
-    result[0] = '\0';
-
-    generate_anagrams_rec(str, 0, strlen(str) - 1, &result, &offset, &capacity);
-
-    if (offset < capacity)
-    {
-        result[offset] = '\0';
-    }
-
-    return result;
-}
-
-
-void compute_serial() 
-{
-    FILE *commandsFile = fopen(INPUT_FILE, "r");
-    if (commandsFile == NULL) 
+    if (deadline_min_ms < 1) 
     {
-        perror("failed to open commands file serial");
+        fprintf(stderr, "DEADLINE_SECONDS must be positive\n");
         exit(EXIT_FAILURE);
     }
-
-    FILE *logFile = fopen(LOG_FILE_S, "w");
-    if (logFile == NULL) 
+    if (arrival_rate < 0 || generated_jobs < 0) 
     {
-        perror("failed to open log file serial");
-        fclose(commandsFile);
+        fprintf(stderr, "JOBS_PER_SECOND and JOBS cannot be negative\n");
         exit(EXIT_FAILURE);
     }
-
-    char buffer[BUFFER_SIZE];
-    while (fgets(buffer, sizeof(buffer), commandsFile)) 
+    for (int opcode = 0; opcode < OP_COUNT; opcode++) 
     {
-        if (strncmp(buffer, "WAIT", 4) == 0) 
-        {
-            continue;
-        } 
-
-        char client[32], task[32], param[32];
-        sscanf(buffer, "%s %s %s", client, task, param);
-
-        if (strcmp(task, "PRIMES") == 0) 
-        {
-            int n = atoi(param);
-            int count = count_primes(n);
-            fprintf(logFile, "Found %d primes in the first %d numbers.\n", count, n);
-            fflush(logFile);
-        } 
-        else if (strcmp(task, "PRIMEDIVISORS") == 0) 
-        {
-            int n = atoi(param);
-            int count = count_prime_divisors(n);
-            fprintf(logFile, "Found %d prime divisors of %d.\n", count, n);
-            fflush(logFile);
-        } 
-        else if (strcmp(task, "ANAGRAMS") == 0) 
-        {
-            char word[32];
-            strcpy(word, param);
-            char *anagrams = generate_anagrams_return(param);
-            fprintf(logFile, "Anagrams of %s are: %s\n", param, anagrams);
-            fflush(logFile);
-            free(anagrams);
-        } 
-        else 
+        if (command_class[opcode] < 0 || command_class[opcode] >= PRIORITY_CLASSES) 
         {
-            fprintf(logFile, "Unknown command: %s", task);
-            fflush(logFile);
+            fprintf(stderr, "priority classes go from 0, the most urgent, to %d\n", PRIORITY_CLASSES - 1);
+            exit(EXIT_FAILURE);
         }
     }
-
-    fclose(commandsFile);
-    fclose(logFile);
 }
 
 
-void *receive_thread(void *arg) 
+// settles the thread count of this rank and tells the main server; without
+// -t the cores of a node are shared evenly among the ranks running on it
+void gather_worker_capacity(int rank, int size, int provided) 
 {
-    char *result = (char*) malloc(ANAGRAM_BUFFER_SIZE);
-    if (!result) 
+    if (worker_threads == 0) 
     {
-        perror("error allocating memory for result");
-        exit(EXIT_FAILURE);
-    }
+        MPI_Comm node;
+        int local_ranks;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+        MPI_Comm_size(node, &local_ranks);
+        MPI_Comm_free(&node);
 
-    while (1)
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_threads = cores / local_ranks > 1 ? cores / local_ranks : 1;
+    }
+    if (provided < MPI_THREAD_MULTIPLE && worker_threads > 1) 
     {
-        MPI_Status status;
-        MPI_Recv(result, ANAGRAM_BUFFER_SIZE, MPI_CHAR, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
-
-        int worker_id = status.MPI_SOURCE;
-
-        if (strcmp(result, "STOP") == 0) 
+        if (rank == 0) 
         {
-            printf("Received STOP from worker %d. Terminating receiver thread.\n", worker_id);
-            break;
+            fprintf(stderr, "MPI without MPI_THREAD_MULTIPLE, running one thread per worker\n");
         }
+        worker_threads = 1;
+    }
 
-        time_t now = time(NULL);
-        char *time_str = ctime(&now);
-        time_str[strlen(time_str) - 1] = '\0';
-        fprintf(log_file, "[%s] Task completed by worker %d\n", time_str, worker_id);
-        fflush(log_file);
-
-        char client[32] = {0};
-        sscanf(result, "%31s", client);
-
-        char filename[64] = {0};
-        snprintf(filename, sizeof(filename), "%s.txt", client);
-
-        FILE *client_file = fopen(filename, "a");
-        if (!client_file) 
+    if (rank == 0) 
+    {
+        worker_capacity = (int*) malloc(size * sizeof(int));
+        if (!worker_capacity) 
         {
-            perror("failed to open client file");
-            continue;
+            perror("failed to allocate memory for worker capacity");
+            exit(EXIT_FAILURE);
         }
-
-        fprintf(client_file, "%s\n", result);
-        fflush(client_file);
-
-        fclose(client_file);
-
-        pthread_mutex_lock(&lock);
-        available_workers[worker_id] = 1;
-        pthread_mutex_unlock(&lock);
     }
-
-    free(result);
-    return NULL;
+    MPI_Gather(&worker_threads, 1, MPI_INT, worker_capacity, 1, MPI_INT, 0, MPI_COMM_WORLD);
 }
 
-void worker_process(int rank) 
+// with -S and every rank on one node, each worker thread gets a ring of
+// anagram chunks in an MPI-3 shared window, which the main server maps too;
+// otherwise chunks keep travelling by message
+void setup_shared_transport(int rank, int size) 
 {
-    char *command = (char*) malloc(BUFFER_SIZE);
-    char *result = (char*) malloc(ANAGRAM_BUFFER_SIZE);
-    if (!command || !result) 
+    if (!shared_transport) 
     {
-        perror("failed to allocate memory in worker");
-        exit(EXIT_FAILURE);
+        return;
     }
 
-    while (1) 
+    MPI_Comm node;
+    int local_ranks;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Comm_size(node, &local_ranks);
+    if (local_ranks < size) 
     {
-        MPI_Recv(command, BUFFER_SIZE, MPI_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-        if (strcmp(command, "STOP") == 0) 
+        if (rank == 0) 
         {
-            snprintf(result, BUFFER_SIZE, "STOP");
-            MPI_Send(result, BUFFER_SIZE, MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-            break;
+            fprintf(stderr, "Ranks on more than one node, anagram results go by message\n");
         }
+        MPI_Comm_free(&node);
+        shared_transport = 0;
+        return;
+    }
 
-        char client[32] = {0}, task[32] = {0}, param[32] = {0};
-        sscanf(command, "%31s %31s %31s", client, task, param);
-
-        if (strcmp(task, "PRIMES") == 0) 
-        {
-            int n = atoi(param);
-            int count = count_primes(n);
-            snprintf(result, BUFFER_SIZE, "%s\nFound %d primes in the first %d numbers.", client, count, n);
-        } 
-        else if (strcmp(task, "PRIMEDIVISORS") == 0) 
-        {
-            int n = atoi(param);
-            int count = count_prime_divisors(n);
-            snprintf(result, BUFFER_SIZE, "%s\nFound %d prime divisors of %d.", client, count, n);
-        } 
-        else if (strcmp(task, "ANAGRAMS") == 0) 
-        {
-            char *anagrams = generate_anagrams_return(param);
-            snprintf(result, ANAGRAM_BUFFER_SIZE, "%s\nAnagrams of %s are: %s\n", client, param, anagrams);
-            free(anagrams);
-        }
-        else 
+    // ranked by world rank, so a worker's rank in node is its worker id
+    SharedRing *rings;
+    MPI_Win_allocate_shared(rank == 0 ? 0 : worker_threads * sizeof(SharedRing), 1, MPI_INFO_NULL, node, &rings, &shared_window);
+    MPI_Comm_free(&node);
+    if (rank != 0) 
+    {
+        for (int t = 0; t < worker_threads; t++) 
         {
-            snprintf(result, BUFFER_SIZE, "Unknown task: %s", command);
+            rings[t].tail = 0;
         }
-
-        MPI_Send(result, ANAGRAM_BUFFER_SIZE, MPI_CHAR, 0, 0, MPI_COMM_WORLD);
+        worker_rings = rings;
     }
-
-    free(command);
-    free(result);
-}
-
-void *send_thread(void *arg) 
-{
-    FILE *input_file = fopen(INPUT_FILE, "r");
-    if (!input_file)
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank != 0) 
     {
-        perror("failed to open commands file parallel");
-        exit(EXIT_FAILURE);
+        return;
     }
 
-    char *buffer = (char*) malloc(BUFFER_SIZE);
-    if (!buffer) 
+    shared_rings = (SharedRing**) calloc(size, sizeof(SharedRing*));
+    if (!shared_rings) 
     {
-        perror("failed to allocate memory for buffer");
+        perror("failed to allocate memory for shared rings");
         exit(EXIT_FAILURE);
     }
-
-    while (fgets(buffer, BUFFER_SIZE, input_file)) 
+    for (int i = 1; i < size; i++) 
     {
-        if (strncmp(buffer, "WAIT", 4) == 0) 
-        {
-            continue;
-        }
-
-        time_t now = time(NULL);
-        char *time_str = ctime(&now);
-        time_str[strlen(time_str) - 1] = '\0';
-        fprintf(log_file, "[%s] Command received: %s\n", time_str, buffer);
-        fflush(log_file);
-
-        int worker_found = 0;
-        while (!worker_found) 
-        {
-            pthread_mutex_lock(&lock);
-            for (int i = 1; i <= num_workers; i++) 
-            {
-                if (available_workers[i]) 
-                {
-                    available_workers[i] = 0;
-                    MPI_Send(buffer, BUFFER_SIZE, MPI_CHAR, i, 0, MPI_COMM_WORLD);
-                    now = time(NULL);
-                    time_str = ctime(&now);
-                    time_str[strlen(time_str) - 1] = '\0';
-                    fprintf(log_file, "[%s] Task dispatched to worker %d: %s\n", time_str, i, buffer);
-                    fflush(log_file);
-                    worker_found = 1;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&lock);
-
-            if (!worker_found) 
-            {
-                usleep(10000); // wait 1 ms before retrying
-            }
-        }
+        MPI_Aint bytes;
+        int unit;
+        MPI_Win_shared_query(shared_window, i, &bytes, &unit, &shared_rings[i]);
     }
+}
 
-    fclose(input_file);
-
-    int all_available = 0;
-    while (!all_available) 
+// the worker ranks wait for the baseline on rank 0 without spinning in MPI,
+// which would take the cores it is being timed on
+void wait_for_baseline(int rank) 
+{
+    MPI_Request request;
+    MPI_Ibarrier(MPI_COMM_WORLD, &request);
+    if (rank == 0) 
     {
-        all_available = 1;
-        pthread_mutex_lock(&lock);
-        for (int i = 1; i <= num_workers; i++) 
-        {
-            if (!available_workers[i]) 
-            {
-                all_available = 0;
-                break;
-            }
-        }
-        pthread_mutex_unlock(&lock);
-
-        if (!all_available)
-        {
-            usleep(10000);
-        }
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        return;
     }
 
-    for (int i = 1; i <= num_workers; i++) 
+    int done = 0;
+    struct timespec pause = { 0, 1000000 };
+    while (MPI_Test(&request, &done, MPI_STATUS_IGNORE) == MPI_SUCCESS && !done) 
     {
-        MPI_Send("STOP", BUFFER_SIZE, MPI_CHAR, i, 0, MPI_COMM_WORLD);
+        nanosleep(&pause, NULL);
     }
-
-    free(buffer);
-    return NULL;
 }
 
+int main(int argc, char *argv[]) 
+{
+    struct timespec start, finish;
 
-void main_server_process(int num_workers)
- {
-    pthread_t send_tid, recv_tid;
+    parse_options(argc, argv);
 
-    initialize_workers();
+    // a stream can only be read once, by the main server
+    int streaming = !benchmark_jobs && is_command_stream(input_path);
 
-    log_file = fopen(LOG_FILE_P, "w");
-    if (!log_file) 
+    // the local executor needs no MPI: baseline, then the thread pool, each
+    // from a cold prime cache
+    if (local_mode) 
     {
-        perror("faield to open log file parallel");
-        exit(EXIT_FAILURE);
-    }
-
-    pthread_create(&send_tid, NULL, send_thread, NULL);
-    pthread_create(&recv_tid, NULL, receive_thread, NULL);
-
-    pthread_join(send_tid, NULL);
-    pthread_join(recv_tid, NULL);
-
-    fclose(log_file);
-}
+        if (streaming) 
+        {
+            fprintf(stderr, "The local executor runs a command file, not a stream\n");
+            exit(EXIT_FAILURE);
+        }
+        if (benchmark_jobs) 
+        {
+            generate_benchmark(BENCHMARK_COMMANDS);
+            input_path = BENCHMARK_COMMANDS;
+        }
 
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        compute_serial();
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        serial_seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
 
+        reset_prime_cache();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        compute_local();
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        local_seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
 
-int main(int argc, char *argv[]) 
-{
-    struct timespec start, finish;
+        if (benchmark_jobs) 
+        {
+            write_benchmark_report();
+        }
+        free(client_names);
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    compute_serial();
-    clock_gettime(CLOCK_MONOTONIC, &finish);
-    double time_taken_serial = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+        printf("\nWall-clock time SERIAL = %lf seconds\n", serial_seconds);
+        printf("Wall-clock time LOCAL = %lf seconds (%d threads, %.3f jobs per second)\n", local_seconds, local_run.threads,
+               local_seconds > 0 ? local_run.count / local_seconds : 0.0);
+        printf("Speedup = %lf\n", serial_seconds / local_seconds);
+        fflush(stdout);
+        return 0;
+    }
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
     int rank, size;
 
-    MPI_Init(&argc, &argv);
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-    if (size >= MAX_WORKERS) 
+    if (size < 2) 
     {
-        if (rank == 0) 
-        {
-            printf("\nWall-clock time SERIAL = %lf seconds\n", time_taken_serial);
-            printf("Error: too many processes; MAX = %d\n", MAX_WORKERS);
-        }
+        printf("Error: at least one worker process is needed\n");
+        MPI_Finalize();
         exit(EXIT_FAILURE);
     }
 
     num_workers = size - 1;
+    gather_worker_capacity(rank, size, provided);
+    setup_shared_transport(rank, size);
+
+    // only rank 0 runs the baseline; the benchmark's commands only exist once
+    // rank 0 has made them
+    if (rank == 0 && !streaming) 
+    {
+        if (benchmark_jobs) 
+        {
+            generate_benchmark(BENCHMARK_COMMANDS);
+            input_path = BENCHMARK_COMMANDS;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        compute_serial();
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        serial_seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    wait_for_baseline(rank);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     if (rank == 0) 
     {
         main_server_process(num_workers);
@@ -460,17 +4570,35 @@ int main(int argc, char *argv[])
     {
         worker_process(rank);
     }
+
+    // a hung worker never reaches MPI_Finalize; every result is written by
+    // now, so the run is torn down instead
+    if (abandoned_workers) 
+    {
+        fflush(stdout);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    if (shared_window != MPI_WIN_NULL) 
+    {
+        MPI_Win_free(&shared_window);
+        free(shared_rings);
+    }
     MPI_Finalize();
     clock_gettime(CLOCK_MONOTONIC, &finish);
     double time_taken_parallel = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
 
-    if (rank == 0) 
+    if (rank == 0 && streaming) 
+    {
+        printf("\nWall-clock time PARALLEL = %lf seconds\n", time_taken_parallel);
+        fflush(stdout);
+    }
+    else if (rank == 0) 
     {
-        printf("\nWall-clock time SERIAL = %lf seconds\n", time_taken_serial);
+        printf("\nWall-clock time SERIAL = %lf seconds\n", serial_seconds);
         fflush(stdout);
         printf("Wall-clock time PARALLEL = %lf seconds\n", time_taken_parallel);
         fflush(stdout);
-        printf("Speedup = %lf\n", time_taken_serial / time_taken_parallel);
+        printf("Speedup = %lf\n", serial_seconds / time_taken_parallel);
         fflush(stdout);
     }
 
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Starts the dispatcher as a server reading a named pipe, sends it one job and
+# checks that the result reaches the client file while the server is still
+# running, before SHUTDOWN is sent.
+#
+# usage: ./test_command_stream.sh [RANKS]
+
+RANKS=${1:-3}
+SRC=$(cd "$(dirname "$0")" && pwd)/job_dispatcher_mpi.c
+DIR=$(mktemp -d)
+cd "$DIR" || exit 1
+
+mpicc -O2 -o dispatcher "$SRC" -lm -lpthread || exit 1
+mkfifo commands.fifo || exit 1
+
+mpirun --oversubscribe -np "$RANKS" ./dispatcher -i commands.fifo > run.txt 2>&1 &
+server=$!
+
+# held open for the whole test, so the server never sees the end of the stream
+exec 3> commands.fifo
+echo "CLI1 PRIMES 1000" >&3
+
+status=1
+tries=0
+while [ $tries -lt 100 ]; do
+    if grep -q "^Found 168 primes in the first 1000 numbers" CLI1.txt 2>/dev/null; then
+        status=0
+        break
+    fi
+    sleep 0.1
+    tries=$((tries + 1))
+done
+
+if [ $status -eq 0 ]; then
+    echo "result delivered while the server runs"
+else
+    echo "no result in CLI1.txt after 10 seconds of a running server"
+fi
+
+echo SHUTDOWN >&3
+exec 3>&-
+wait $server || { echo "server failed"; cat run.txt; status=1; }
+
+cd / && rm -rf "$DIR"
+exit $status